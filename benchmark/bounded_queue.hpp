@@ -0,0 +1,89 @@
+#ifndef BOUNDED_QUEUE_HPP_
+#define BOUNDED_QUEUE_HPP_
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+// A blocking FIFO with a fixed capacity, used to hand items from one thread to another.
+template<typename T>
+class BoundedQueue {
+  public:
+    explicit BoundedQueue(size_t capacity) : capacity_(capacity > 0 ? capacity : 1) {}
+
+    // Blocks while the queue is full. Returns false if the queue has been closed.
+    bool Push(T item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this] { return closed_ || items_.size() < capacity_; });
+        if (closed_) return false;
+        items_.push_back(std::move(item));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // Blocks while the queue is empty. Returns false once the queue is closed and drained.
+    bool Pop(T* item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+        if (items_.empty()) return false;
+        *item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    // Like Push, but returns false at once instead of waiting if the queue is full. |item| is
+    // then dropped.
+    bool TryPush(T item) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_ || items_.size() >= capacity_) return false;
+        items_.push_back(std::move(item));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // Like Pop, but returns false at once instead of waiting if the queue is empty.
+    bool TryPop(T* item) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (items_.empty()) return false;
+        *item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    enum PopStatus { kPopped, kTimedOut, kClosed };
+
+    // Like Pop, but gives up waiting at |deadline|.
+    PopStatus PopUntil(T* item, std::chrono::steady_clock::time_point deadline) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!not_empty_.wait_until(lock, deadline, [this] { return closed_ || !items_.empty(); })) {
+            return kTimedOut;
+        }
+        if (items_.empty()) return kClosed;
+        *item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return kPopped;
+    }
+
+    // Rejects further pushes and wakes up all waiters. Queued items can still be popped.
+    void Close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+  private:
+    const size_t capacity_;
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    std::deque<T> items_;
+    bool closed_ = false;
+};
+
+#endif  // BOUNDED_QUEUE_HPP_
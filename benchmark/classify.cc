@@ -1,3 +1,7 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
 #include <algorithm>
 #include <chrono>
 #include <fstream>
@@ -7,12 +11,20 @@
 
 #include <benchmark/benchmark.h>
 #include <gflags/gflags.h>
+#include <tensorflow/core/framework/op.h>
 #include <tensorflow/core/public/session.h>
 
-#include "test_video.hpp"
+#include "frame_cache.hpp"
+#include "preprocess.hpp"
+#include "latency_recorder.hpp"
+#include "results.hpp"
+#include "utils.hpp"
 
 DEFINE_string(testdata_dir, "testdata", "");
 DEFINE_int32(ffmpeg_log_level, 16, "");
+DEFINE_string(frame_cache_dir, "",
+              "If not empty, keep the decoded test images in this directory, so later runs map "
+              "them instead of decoding.");
 
 namespace {
 
@@ -36,31 +48,18 @@ std::string JoinStrings(const std::vector<std::string>& items, const std::string
     return result;
 }
 
-void AVFrameToTensor(AVFrame* frame, tensorflow::Tensor* tensor) {
+// Copies a packed frame of |stride| bytes per row into |tensor|, which has its size.
+void FrameToTensor(const uint8_t* data, int stride, tensorflow::Tensor* tensor) {
     CHECK_EQ(tensor->dims(), 4);
-    const int size = tensor->NumElements();
-    const int row_elems = frame->width * tensor->dim_size(3);
+    const int height = tensor->dim_size(1);
+    const int row_elems = tensor->dim_size(2) * tensor->dim_size(3);
     switch (tensor->dtype()) {
         case tensorflow::DT_FLOAT:
-            {
-                float* data = tensor->flat<float>().data();
-                for (int i = 0; i < size; i++) {
-                    const int row = i / row_elems;
-                    const int pos = row * frame->linesize[0] + (i % row_elems);
-                    data[i] = frame->data[0][pos] / 256.f;
-                }
-                break;
-            }
+            NormalizeRows(data, stride, row_elems, height, 0.f, 1 / 256.f,
+                          tensor->flat<float>().data());
+            break;
         case tensorflow::DT_UINT8:
-            {
-                uint8_t* dst = tensor->flat<uint8_t>().data();
-                uint8_t* src = frame->data[0];
-                for (int row = 0; row < frame->height; row++) {
-                    memcpy(dst, src, row_elems);
-                    dst += row_elems;
-                    src += frame->linesize[0];
-                }
-            }
+            CopyRows(data, stride, row_elems, height, tensor->flat<uint8_t>().data(), row_elems);
             break;
         default:
             LOG(FATAL) << "Should not reach here!";
@@ -113,9 +112,27 @@ std::vector<std::string> GetTopN(const tensorflow::Tensor& tensor,
     return topn_labels;
 }
 
-void RunInterpreter(const std::string& model_file, uint32_t width, uint32_t height,
-                    const std::string& labels_file, const std::string& image_pat,
-                    const std::string& results_file, benchmark::State& state) {
+// TF uses MKL-DNN kernels if built with --config=mkl, unless TF_DISABLE_MKL is true when it
+// starts. The library is asked how it was built, by looking for an op it only registers with
+// MKL. INTEL_MKL would only tell how this binary was built.
+const char* MklLabel() {
+    static const bool mkl_built = [] {
+        const tensorflow::OpDef* op_def = nullptr;
+        return tensorflow::OpRegistry::Global()->LookUpOpDef("_MklConv2D", &op_def).ok();
+    }();
+    if (!mkl_built) return "no_mkl";
+    // Read the way TF reads it, as "1" or "true" in any case.
+    const char* disable_mkl = getenv("TF_DISABLE_MKL");
+    const bool mkl_off = disable_mkl != nullptr &&
+        (strcmp(disable_mkl, "1") == 0 || strcasecmp(disable_mkl, "true") == 0);
+    return mkl_off ? "mkl_off" : "mkl";
+}
+
+// Records the result as |name| in --results_json.
+void RunInterpreter(const std::string& name, const std::string& model_file, uint32_t width,
+                    uint32_t height, const std::string& labels_file, const std::string& image_pat,
+                    const std::string& results_file, int intra_op_threads,
+                    int inter_op_threads, benchmark::State& state) {
     // Load model.
     tensorflow::GraphDef graph_def;
     if (!tensorflow::ReadBinaryProto(tensorflow::Env::Default(), model_file, &graph_def).ok()) {
@@ -127,8 +144,8 @@ void RunInterpreter(const std::string& model_file, uint32_t width, uint32_t heig
     std::unique_ptr<tensorflow::Session> session;
     tensorflow::SessionOptions sess_opts;
     sess_opts.config.mutable_device_count()->insert({"CPU", 1});
-    sess_opts.config.set_intra_op_parallelism_threads(1);
-    sess_opts.config.set_inter_op_parallelism_threads(1);
+    sess_opts.config.set_intra_op_parallelism_threads(intra_op_threads);
+    sess_opts.config.set_inter_op_parallelism_threads(inter_op_threads);
     sess_opts.config.set_allow_soft_placement(1);
     sess_opts.config.set_isolate_session_state(1);
     session.reset(tensorflow::NewSession(sess_opts));
@@ -201,33 +218,37 @@ void RunInterpreter(const std::string& model_file, uint32_t width, uint32_t heig
         return;
     }
 
+    // Decoded once, so the iterations only convert and run. BM_DecodePreprocess in
+    // classify_lite measures the decoding.
+    const FrameCache* cache = FrameCache::Load(image_pat, "image2", true, pix_fmt, width, height,
+                                               FLAGS_frame_cache_dir);
+    if (cache == nullptr) {
+        state.SkipWithError("failed to decode test images");
+        return;
+    }
+
     // Run.
     int correct = 0;
     int wrong = 0;
     int frames = 0;
-    int total_ms = 0;
+    LatencyRecorder latency;
+    double run_secs = 0;
+    double cpu_secs = 0;
     for (auto _ : state) {
-        TestVideo test_video(pix_fmt, width, height);
-        if (!test_video.Init(image_pat, "image2", true)) {
-            state.SkipWithError("failed to open test video");
-            return;
-        }
         double iteration_secs = 0;
-        int index = 0;
-        AVFrame* frame = nullptr;
-        while ((frame = test_video.NextFrame())) {
+        for (int index = 0; index < cache->frames(); index++) {
             std::vector<tensorflow::Tensor> output_tensors;
             const auto start = std::chrono::high_resolution_clock::now();
-            AVFrameToTensor(frame, &input_tensor);
+            const double cpu_start = ProcessCpuSecs();
+            FrameToTensor(cache->frame(index), cache->stride(), &input_tensor);
             const auto status = session->Run(
                 {{input->name(), input_tensor}}, output_names, {}, &output_tensors);
+            cpu_secs += ProcessCpuSecs() - cpu_start;
             const std::chrono::duration<double> duration =
                 std::chrono::high_resolution_clock::now() - start;
             iteration_secs += duration.count();
-            const auto elapsed_ms =
-                std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
-            total_ms += elapsed_ms;
-            av_frame_free(&frame);
+            const double elapsed_ms = duration.count() * 1000;
+            latency.Record(duration);
             if (!status.ok()) {
                 state.SkipWithError("failed to call Session::Run!");
                 return;
@@ -241,8 +262,8 @@ void RunInterpreter(const std::string& model_file, uint32_t width, uint32_t heig
             frames++;
             VLOG(0) << index << ": expected=" << results[index] << ", got='" << JoinStrings(topn, "|")
                 << "', ms=" << elapsed_ms;
-            index++;
         }
+        run_secs += iteration_secs;
         state.SetIterationTime(iteration_secs);
     }
     VLOG(0) << "Precision=" << (float)correct / (correct + wrong)
@@ -250,7 +271,42 @@ void RunInterpreter(const std::string& model_file, uint32_t width, uint32_t heig
     state.counters["correct"] = correct;
     state.counters["wrong"] = wrong;
     state.counters["frames"] = frames;
-    state.counters["ms"] = total_ms;
+    state.counters["ms"] = latency.sum_ms();
+    state.counters["p50_ms"] = latency.PercentileMs(50);
+    state.counters["p95_ms"] = latency.PercentileMs(95);
+    state.counters["p99_ms"] = latency.PercentileMs(99);
+    state.counters["max_ms"] = latency.max_ms();
+    // Throughput, latency, and the CPU time of all threads of the session, per frame.
+    state.counters["fps"] = frames / std::max(run_secs, 1e-9);
+    state.counters["mspf"] = run_secs * 1000 / std::max(1, frames);
+    state.counters["cpu_mspf"] = cpu_secs * 1000 / std::max(1, frames);
+
+    BenchmarkResult result;
+    result.name = name;
+    result.model = model_file.substr(model_file.find_last_of('/') + 1);
+    result.backend = "tf";
+    result.threads = intra_op_threads;
+    result.width = width;
+    result.height = height;
+    result.config["inter_op_threads"] = std::to_string(inter_op_threads);
+    result.config["mkl"] = MklLabel();
+    result.frames = frames;
+    result.wall_secs = run_secs;
+    result.latency = latency;
+    result.counters["correct"] = correct;
+    result.counters["wrong"] = wrong;
+    result.counters["accuracy"] = (double)correct / std::max(1, correct + wrong);
+    result.counters["cpu_mspf"] = cpu_secs * 1000 / std::max(1, frames);
+    AddBenchmarkResult(result, state.iterations());
+}
+
+// Every model runs with each of these numbers of intra-op and inter-op threads. Pick some with
+// e.g. --benchmark_filter='intra:4/inter:1'.
+void TfThreadVariants(benchmark::internal::Benchmark* b) {
+    b->ArgNames({"intra", "inter"});
+    for (const int intra_op_threads : {1, 2, 4}) {
+        for (const int inter_op_threads : {1, 2}) b->Args({intra_op_threads, inter_op_threads});
+    }
 }
 
 #define MOBILENET_BENCHMARK(name, file, width, height) \
@@ -259,9 +315,12 @@ void BM_Mobilenet_##name(benchmark::State& state) { \
     const std::string labels_file = FLAGS_testdata_dir + "/mobilenet_labels.txt"; \
     const std::string image2_pat = FLAGS_testdata_dir + "/%03d.png"; \
     const std::string results_file = FLAGS_testdata_dir + "/results.txt"; \
-    RunInterpreter(model_file, width, height, labels_file, image2_pat, results_file, state); \
+    state.SetLabel(MklLabel()); \
+    RunInterpreter("BM_Mobilenet_" #name, model_file, width, height, labels_file, image2_pat, \
+                   results_file, state.range(0), state.range(1), state); \
 } \
-BENCHMARK(BM_Mobilenet_##name)->UseManualTime()->Unit(benchmark::kMillisecond)->MinTime(5.0) \
+BENCHMARK(BM_Mobilenet_##name)->Apply(TfThreadVariants)->UseManualTime() \
+    ->Unit(benchmark::kMillisecond)->MinTime(5.0) \
 
 MOBILENET_BENCHMARK(v1_1_0_224_quant, "v1_1.0_224_quant", 224, 224);
 MOBILENET_BENCHMARK(v1_1_0_192_quant, "v1_1.0_192_quant", 192, 192);
@@ -302,10 +361,12 @@ MOBILENET_BENCHMARK(v2_0_75_96, "v2_0.75_96", 96, 96);
 }  // namespace
 
 int main(int argc, char** argv) {
-    google::ParseCommandLineFlags(&argc, &argv, true);
+    // The benchmark library takes its flags out first, gflags would reject them.
     benchmark::Initialize(&argc, argv);
+    google::ParseCommandLineFlags(&argc, &argv, true);
     InitFfmpeg(FLAGS_ffmpeg_log_level);
     benchmark::RunSpecifiedBenchmarks();
+    return WriteResults() ? 0 : 1;
 }
 
 /*
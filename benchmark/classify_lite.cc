@@ -10,10 +10,18 @@
 #include <tensorflow/lite/kernels/register.h>
 #include <tensorflow/lite/model.h>
 
+#include "frame_cache.hpp"
+#include "preprocess.hpp"
+#include "latency_recorder.hpp"
+#include "results.hpp"
 #include "test_video.hpp"
+#include "tflite_cpu.hpp"
 
 DEFINE_string(testdata_dir, "testdata", "");
 DEFINE_int32(ffmpeg_log_level, 16, "");
+DEFINE_string(frame_cache_dir, "",
+              "If not empty, keep the decoded test images in this directory, so later runs map "
+              "them instead of decoding.");
 
 namespace {
 
@@ -37,17 +45,17 @@ std::string JoinStrings(const std::vector<std::string>& items, const std::string
     return result;
 }
 
-void AVFrameToTensor(AVFrame* frame, TfLiteTensor* input) {
+// Copies a packed frame of |stride| bytes per row into |input|, which has its size.
+void FrameToTensor(const uint8_t* data, int stride, TfLiteTensor* input) {
     CHECK_EQ(input->dims->size, 4);
-    const int size = input->dims->data[1] * input->dims->data[2] * input->dims->data[3];
+    const int height = input->dims->data[1];
+    const int row_elems = input->dims->data[2] * input->dims->data[3];
     switch (input->type) {
         case kTfLiteFloat32:
-            for (int i = 0; i < size; i++) {
-                input->data.f[i] = frame->data[0][i] / 256.f;
-            }
+            NormalizeRows(data, stride, row_elems, height, 0.f, 1 / 256.f, input->data.f);
             break;
         case kTfLiteUInt8:
-            memcpy(input->data.uint8, frame->data[0], size);
+            CopyRows(data, stride, row_elems, height, input->data.uint8, row_elems);
             break;
         default:
             LOG(FATAL) << "Should not reach here!";
@@ -91,8 +99,10 @@ std::vector<std::string> GetTopN(TfLiteTensor* output, const std::vector<std::st
     return topn_labels;
 }
 
-void RunInterpreter(const std::string& model_file, const std::string& labels_file,
-                    const std::string& image_pat, const std::string& results_file,
+// Records the result as |name| in --results_json.
+void RunInterpreter(const std::string& name, const std::string& model_file,
+                    const std::string& labels_file, const std::string& image_pat,
+                    const std::string& results_file, const TfliteCpuOptions& cpu_options,
                     benchmark::State& state) {
     // Load model.
     auto model = tflite::FlatBufferModel::BuildFromFile(model_file.c_str());
@@ -112,7 +122,11 @@ void RunInterpreter(const std::string& model_file, const std::string& labels_fil
         state.SkipWithError("failed to allocate tensors");
         return;
     }
-    interpreter->SetNumThreads(1);
+    if (!ApplyTfliteCpuOptions(cpu_options, interpreter.get())) {
+        state.SkipWithError("failed to apply cpu options");
+        return;
+    }
+    state.SetLabel(TfliteDelegateName(cpu_options.delegate));
     // Get input / output.
     const int input = interpreter->inputs()[0];
     TfLiteTensor* input_tensor = interpreter->tensor(input);
@@ -134,31 +148,31 @@ void RunInterpreter(const std::string& model_file, const std::string& labels_fil
         return;
     }
 
+    // Decoded once, so the iterations only convert and run. BM_DecodePreprocess measures the
+    // decoding.
+    const FrameCache* cache = FrameCache::Load(image_pat, "image2", true, pix_fmt, width, height,
+                                               FLAGS_frame_cache_dir);
+    if (cache == nullptr) {
+        state.SkipWithError("failed to decode test images");
+        return;
+    }
+
     // Run.
     int correct = 0;
     int wrong = 0;
     int frames = 0;
-    int total_ms = 0;
+    LatencyRecorder latency;
     for (auto _ : state) {
-        TestVideo test_video(pix_fmt, width, height);
-        if (!test_video.Init(image_pat, "image2", true)) {
-            state.SkipWithError("failed to open test video");
-            return;
-        }
-        int index = 0;
         double iteration_secs = 0;
-        AVFrame* frame = nullptr;
-        while ((frame = test_video.NextFrame())) {
+        for (int index = 0; index < cache->frames(); index++) {
             const auto start = std::chrono::high_resolution_clock::now();
-            AVFrameToTensor(frame, input_tensor);
+            FrameToTensor(cache->frame(index), cache->stride(), input_tensor);
             const TfLiteStatus rc = interpreter->Invoke();
             const std::chrono::duration<double> duration =
                 std::chrono::high_resolution_clock::now() - start;
             iteration_secs += duration.count();
-            const auto elapsed_ms =
-                std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
-            total_ms += elapsed_ms;
-            av_frame_free(&frame);
+            const double elapsed_ms = duration.count() * 1000;
+            latency.Record(duration);
             if (rc != kTfLiteOk) {
                 state.SkipWithError("failed to call Interpreter::Invoke!");
                 return;
@@ -172,7 +186,6 @@ void RunInterpreter(const std::string& model_file, const std::string& labels_fil
             frames++;
             VLOG(1) << index << ": expected=" << results[index] << ", got='" << JoinStrings(topn, "|")
                 << "', ms=" << elapsed_ms;
-            index++;
         }
         state.SetIterationTime(iteration_secs);
     }
@@ -181,7 +194,38 @@ void RunInterpreter(const std::string& model_file, const std::string& labels_fil
     state.counters["correct"] = correct;
     state.counters["wrong"] = wrong;
     state.counters["frames"] = frames;
-    state.counters["ms"] = total_ms;
+    state.counters["ms"] = latency.sum_ms();
+    state.counters["p50_ms"] = latency.PercentileMs(50);
+    state.counters["p95_ms"] = latency.PercentileMs(95);
+    state.counters["p99_ms"] = latency.PercentileMs(99);
+    state.counters["max_ms"] = latency.max_ms();
+    state.counters["mspf"] = latency.mean_ms();
+
+    BenchmarkResult result;
+    result.name = name;
+    result.model = model_file.substr(model_file.find_last_of('/') + 1);
+    result.backend = "tflite";
+    result.threads = cpu_options.threads;
+    result.width = width;
+    result.height = height;
+    result.config["delegate"] = TfliteDelegateName(cpu_options.delegate);
+    result.frames = frames;
+    result.wall_secs = latency.sum_ms() / 1000;
+    result.latency = latency;
+    result.counters["correct"] = correct;
+    result.counters["wrong"] = wrong;
+    result.counters["accuracy"] = (double)correct / std::max(1, correct + wrong);
+    AddBenchmarkResult(result, state.iterations());
+}
+
+// Every model runs with each built in delegate at each of these thread counts. Pick some with
+// e.g. --benchmark_filter='delegate:1/threads:4'.
+void TfliteCpuVariants(benchmark::internal::Benchmark* b) {
+    b->ArgNames({"delegate", "threads"});
+    for (const auto delegate : {TfliteCpuOptions::kNone, TfliteCpuOptions::kXnnpack}) {
+        if (!HasTfliteDelegate(delegate)) continue;
+        for (const int threads : {1, 2, 4}) b->Args({delegate, threads});
+    }
 }
 
 #define MOBILENET_BENCHMARK(name, file) \
@@ -190,9 +234,14 @@ void BM_Mobilenet_##name(benchmark::State& state) { \
     const std::string labels_file = FLAGS_testdata_dir + "/mobilenet_labels.txt"; \
     const std::string image2_pat = FLAGS_testdata_dir + "/%03d.png"; \
     const std::string results_file = FLAGS_testdata_dir + "/results.txt"; \
-    RunInterpreter(model_file, labels_file, image2_pat, results_file, state); \
+    TfliteCpuOptions cpu_options; \
+    cpu_options.delegate = static_cast<TfliteCpuOptions::Delegate>(state.range(0)); \
+    cpu_options.threads = state.range(1); \
+    RunInterpreter("BM_Mobilenet_" #name, model_file, labels_file, image2_pat, results_file, \
+                   cpu_options, state); \
 } \
-BENCHMARK(BM_Mobilenet_##name)->UseManualTime()->Unit(benchmark::kMillisecond)->MinTime(5.0) \
+BENCHMARK(BM_Mobilenet_##name)->Apply(TfliteCpuVariants)->UseManualTime() \
+    ->Unit(benchmark::kMillisecond)->MinTime(5.0) \
 
 MOBILENET_BENCHMARK(v1_1_0_224_quant, "v1_1.0_224_quant");
 MOBILENET_BENCHMARK(v1_1_0_192_quant, "v1_1.0_192_quant");
@@ -230,15 +279,87 @@ MOBILENET_BENCHMARK(v2_0_75_160, "v2_0.75_160");
 MOBILENET_BENCHMARK(v2_0_75_128, "v2_0.75_128");
 MOBILENET_BENCHMARK(v2_0_75_96, "v2_0.75_96");
 
+// What the model benchmarks leave out by replaying cached frames: decoding the test images at a
+// model input size and converting them to its input type, uint8 or float.
+void BM_DecodePreprocess(benchmark::State& state) {
+    const std::string image_pat = FLAGS_testdata_dir + "/%03d.png";
+    const int size = state.range(0);
+    const bool to_float = state.range(1);
+    const int row_elems = size * 3;
+    std::vector<uint8_t> uint8_input(row_elems * size);
+    std::vector<float> float_input(row_elems * size);
+    int frames = 0;
+    LatencyRecorder latency;
+    int64_t frame_allocations = 0;
+    double decode_secs = 0;
+    for (auto _ : state) {
+        TestVideo test_video(AV_PIX_FMT_RGB24, size, size);
+        if (!test_video.Init(image_pat, "image2", true)) {
+            state.SkipWithError("failed to open test video");
+            return;
+        }
+        FrameHandle frame;
+        auto start = std::chrono::high_resolution_clock::now();
+        while (test_video.NextFrame(&frame)) {
+            if (to_float) {
+                NormalizeRows(frame->data[0], frame->linesize[0], row_elems, size, 0.f,
+                              1 / 256.f, float_input.data());
+            } else {
+                CopyRows(frame->data[0], frame->linesize[0], row_elems, size,
+                         uint8_input.data(), row_elems);
+            }
+            frame.Reset();
+            const auto end = std::chrono::high_resolution_clock::now();
+            latency.Record(end - start);
+            start = end;
+            frames++;
+        }
+        frame_allocations += test_video.frame_allocations();
+        decode_secs += test_video.decode_secs();
+    }
+    state.counters["frames"] = frames;
+    state.counters["p50_ms"] = latency.PercentileMs(50);
+    state.counters["p95_ms"] = latency.PercentileMs(95);
+    state.counters["mspf"] = latency.mean_ms();
+    // The decoding part of mspf.
+    state.counters["decode_mspf"] = decode_secs * 1000 / std::max(1, frames);
+    // AVFrames allocated per iteration. A few at most, not one per frame.
+    state.counters["frame_allocs"] = (double)frame_allocations / state.iterations();
+
+    BenchmarkResult result;
+    result.name = "BM_DecodePreprocess";
+    result.backend = "ffmpeg";
+    result.width = size;
+    result.height = size;
+    result.config["dtype"] = to_float ? "float" : "uint8";
+    result.frames = frames;
+    result.wall_secs = latency.sum_ms() / 1000;
+    result.latency = latency;
+    result.counters["decode_mspf"] = decode_secs * 1000 / std::max(1, frames);
+    AddBenchmarkResult(result, state.iterations());
+}
+
+// The input sizes of the models above, each converted to uint8 and to float.
+void DecodeVariants(benchmark::internal::Benchmark* b) {
+    b->ArgNames({"size", "float"});
+    for (const int size : {96, 128, 160, 192, 224}) {
+        for (const int to_float : {0, 1}) b->Args({size, to_float});
+    }
+}
+
+BENCHMARK(BM_DecodePreprocess)->Apply(DecodeVariants)->Unit(benchmark::kMillisecond);
+
 }  // namespace
 
 int main(int argc, char** argv) {
     google::SetCommandLineOption("v", "1");
+    // The benchmark library takes its flags out first, gflags would reject them.
+    benchmark::Initialize(&argc, argv);
     google::ParseCommandLineFlags(&argc, &argv, true);
     google::InitGoogleLogging(argv[0]);
-    benchmark::Initialize(&argc, argv);
     InitFfmpeg(FLAGS_ffmpeg_log_level);
     benchmark::RunSpecifiedBenchmarks();
+    return WriteResults() ? 0 : 1;
 }
 
 /*
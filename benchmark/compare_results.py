@@ -0,0 +1,209 @@
+#!/usr/bin/env python3
+"""Compares two sets of benchmark results written with --results_json and flags regressions.
+
+Each argument is a results file or a directory of them, e.g. the RESULTS_DIR of two builds:
+
+    make run_classify_lite RESULTS_DIR=base BENCHMARK_REPETITIONS=5
+    ... change and rebuild ...
+    make run_classify_lite RESULTS_DIR=new BENCHMARK_REPETITIONS=5
+    benchmark/compare_results.py base new
+
+Results of the same binary, name and configuration are repetitions of one benchmark: the runs of
+--run_count, --benchmark_repetitions or the epochs of mnist. A metric has regressed if Welch's
+t-test finds the two sets of repetitions different with p < --alpha, and it got worse by more
+than --min_change. It takes at least 2 repetitions on each side to test a benchmark, so a single
+run is only reported. Exits with 1 if anything regressed.
+"""
+
+import argparse
+import json
+import math
+import os
+import sys
+
+# Name, how to get it from a result, whether higher is better.
+METRICS = [
+    ('mean_ms', lambda r: r['latency_ms']['mean'], False),
+    ('p50_ms', lambda r: r['latency_ms']['p50'], False),
+    ('p95_ms', lambda r: r['latency_ms']['p95'], False),
+    ('p99_ms', lambda r: r['latency_ms']['p99'], False),
+    ('fps', lambda r: r['fps'], True),
+]
+# Counters whose drop is a regression too, by an absolute amount rather than relative.
+ACCURACY_COUNTERS = ['accuracy']
+
+
+def load(path):
+    """Returns the results under |path| by benchmark key, and the CPUs they ran on."""
+    if os.path.isdir(path):
+        files = sorted(os.path.join(path, f) for f in os.listdir(path) if f.endswith('.json'))
+    else:
+        files = [path]
+    results = {}
+    cpus = set()
+    for file_name in files:
+        with open(file_name) as f:
+            doc = json.load(f)
+        context = doc['context']
+        cpus.add(context['cpu'])
+        for result in doc['results']:
+            results.setdefault(key_of(context['binary'], result), []).append(result)
+    return results, cpus
+
+
+def key_of(binary, result):
+    config = ' '.join('%s=%s' % item for item in sorted(result['config'].items()))
+    return '%s %s %s/%s threads=%d batch=%d %dx%d %s' % (
+        binary, result['name'], result['model'], result['backend'], result['threads'],
+        result['batch_size'], result['width'], result['height'], config)
+
+
+def mean_var(samples):
+    mean = sum(samples) / len(samples)
+    if len(samples) < 2:
+        return mean, 0.
+    return mean, sum((x - mean) ** 2 for x in samples) / (len(samples) - 1)
+
+
+def betacf(a, b, x):
+    """Continued fraction of the incomplete beta function, by the modified Lentz method."""
+    tiny = 1e-300
+    c = 1.
+    d = 1. - (a + b) * x / (a + 1.)
+    d = 1. / (d if abs(d) > tiny else tiny)
+    h = d
+    for m in range(1, 300):
+        for num in (m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m)),
+                    -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1))):
+            d = 1. + num * d
+            d = 1. / (d if abs(d) > tiny else tiny)
+            c = 1. + num / c
+            c = c if abs(c) > tiny else tiny
+            h *= d * c
+        if abs(d * c - 1.) < 1e-12:
+            break
+    return h
+
+
+def betainc(a, b, x):
+    """The regularized incomplete beta function I_x(a, b)."""
+    if x <= 0. or x >= 1.:
+        return max(0., min(1., x))
+    front = math.exp(math.lgamma(a + b) - math.lgamma(a) - math.lgamma(b) +
+                     a * math.log(x) + b * math.log(1. - x))
+    if x < (a + 1.) / (a + b + 2.):
+        return front * betacf(a, b, x) / a
+    return 1. - front * betacf(b, a, 1. - x) / b
+
+
+def welch_p(base, new):
+    """Two-sided p-value of Welch's t-test that |base| and |new| have the same mean."""
+    mean_a, var_a = mean_var(base)
+    mean_b, var_b = mean_var(new)
+    se2_a = var_a / len(base)
+    se2_b = var_b / len(new)
+    if se2_a + se2_b == 0.:
+        return 1. if mean_a == mean_b else 0.
+    t = (mean_b - mean_a) / math.sqrt(se2_a + se2_b)
+    df = (se2_a + se2_b) ** 2 / (se2_a ** 2 / (len(base) - 1) + se2_b ** 2 / (len(new) - 1))
+    return betainc(df / 2., .5, df / (df + t * t))
+
+
+def compare(name, base, new, higher_is_better, threshold, relative, args):
+    """Returns one line about a metric, and REGRESSION, improved, untested or empty."""
+    mean_a = sum(base) / len(base)
+    mean_b = sum(new) / len(new)
+    change = mean_b - mean_a
+    if relative:
+        change = change / mean_a if mean_a != 0 else 0.
+    worse = -change if higher_is_better else change
+    p = welch_p(base, new) if len(base) >= 2 and len(new) >= 2 else float('nan')
+    if p < args.alpha and worse > threshold:
+        verdict = 'REGRESSION'
+    elif p < args.alpha and -worse > threshold:
+        verdict = 'improved'
+    elif math.isnan(p) and abs(worse) > threshold:
+        # Worth a look, but too few runs to tell it from noise.
+        verdict = 'untested'
+    else:
+        verdict = ''
+    change_str = '%+.1f%%' % (change * 100) if relative else '%+.4f' % change
+    line = '  %-10s %12.4g (%2d) %12.4g (%2d) %9s %8.3g  %s' % (
+        name, mean_a, len(base), mean_b, len(new), change_str, p, verdict)
+    return line.rstrip(), verdict
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('baseline', help='Results file or directory to compare against.')
+    parser.add_argument('candidate', help='Results file or directory to check.')
+    parser.add_argument('--alpha', type=float, default=.01,
+                        help='Significance level of the t-test.')
+    parser.add_argument('--min_change', type=float, default=.03,
+                        help='Smallest relative slowdown flagged, e.g. .03 for 3%%.')
+    parser.add_argument('--max_accuracy_drop', type=float, default=.005,
+                        help='Smallest absolute drop of an accuracy counter flagged.')
+    parser.add_argument('--all', action='store_true',
+                        help='Also list the benchmarks without significant changes.')
+    args = parser.parse_args()
+
+    base, base_cpus = load(args.baseline)
+    new, new_cpus = load(args.candidate)
+    if base_cpus != new_cpus:
+        print('Warning: the results ran on different CPUs: %s vs %s' %
+              (', '.join(sorted(base_cpus)), ', '.join(sorted(new_cpus))))
+
+    regressions = 0
+    untested = 0
+    for key in sorted(set(base) & set(new)):
+        lines = []
+        regressed = False
+        interesting = args.all
+        for name, get, higher_is_better in METRICS:
+            base_values = [get(r) for r in base[key]]
+            new_values = [get(r) for r in new[key]]
+            if None in base_values or None in new_values:
+                continue
+            line, verdict = compare(name, base_values, new_values, higher_is_better,
+                                    args.min_change, True, args)
+            lines.append(line)
+            regressed |= verdict == 'REGRESSION'
+            interesting |= verdict != ''
+        for name in sorted(set(base[key][0]['counters']) & set(new[key][0]['counters'])):
+            base_values = [r['counters'][name] for r in base[key]]
+            new_values = [r['counters'][name] for r in new[key]]
+            if None in base_values or None in new_values:
+                continue
+            if name in ACCURACY_COUNTERS:
+                line, verdict = compare(name, base_values, new_values, True,
+                                        args.max_accuracy_drop, False, args)
+                lines.append(line)
+                regressed |= verdict == 'REGRESSION'
+                interesting |= verdict != ''
+            elif sum(base_values) / len(base_values) != sum(new_values) / len(new_values):
+                # Other counters only tell that the benchmark did something else, e.g. found
+                # other detections.
+                lines.append(compare(name, base_values, new_values, True, float('inf'), True,
+                                     args)[0])
+                interesting = True
+        if len(base[key]) < 2 or len(new[key]) < 2:
+            untested += 1
+        if regressed:
+            regressions += 1
+        if interesting or regressed:
+            print(key)
+            print('  %-10s %17s %17s %9s %8s' % ('metric', 'baseline (n)', 'candidate (n)',
+                                                 'change', 'p'))
+            print('\n'.join(lines))
+    for key in sorted(set(base) - set(new)):
+        print('Only in baseline: ' + key)
+    for key in sorted(set(new) - set(base)):
+        print('Only in candidate: ' + key)
+    print('%d benchmarks compared, %d regressed, %d with less than 2 runs on a side untested.' %
+          (len(set(base) & set(new)), regressions, untested))
+    return 1 if regressions > 0 else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,180 @@
+#include "frame_cache.hpp"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include <glog/logging.h>
+
+#include "test_video.hpp"
+
+namespace {
+
+// Layout of a cache file: this header, padded to kHeaderBytes so the frames are aligned, then the
+// frames one after the other.
+struct CacheFileHeader {
+    char magic[8];
+    int32_t width;
+    int32_t height;
+    int32_t channels;
+    int32_t frames;
+};
+
+const char kMagic[8] = {'F', 'R', 'A', 'M', 'E', 'S', '0', '1'};
+const size_t kHeaderBytes = 64;
+static_assert(sizeof(CacheFileHeader) <= kHeaderBytes, "header does not fit");
+
+// FNV-1a, to tell sources with the same base name apart in the cache file name.
+uint32_t HashString(const std::string& s) {
+    uint32_t hash = 2166136261u;
+    for (const char c : s) hash = (hash ^ (uint8_t)c) * 16777619u;
+    return hash;
+}
+
+std::string CacheFileName(const std::string& file, enum AVPixelFormat pix_fmt, int width,
+                          int height) {
+    std::string base = file.substr(file.find_last_of('/') + 1);
+    for (char& c : base) {
+        if (!isalnum((unsigned char)c) && c != '.' && c != '-') c = '_';
+    }
+    return Sprintf("%s-%08x.%dx%d.%s.frames", base.c_str(), HashString(file), width, height,
+                   av_get_pix_fmt_name(pix_fmt));
+}
+
+}  // namespace
+
+const FrameCache* FrameCache::Load(const std::string& file, const char* format, bool keep_ar,
+                                   enum AVPixelFormat pix_fmt, int width, int height,
+                                   const std::string& cache_dir) {
+    static std::mutex mutex;
+    static std::map<std::string, std::unique_ptr<FrameCache>> caches;
+    const std::string key = Sprintf("%s|%s|%d|%s|%dx%d|%s", file.c_str(), format ? format : "",
+                                    keep_ar, av_get_pix_fmt_name(pix_fmt), width, height,
+                                    cache_dir.c_str());
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = caches.find(key);
+    if (it != caches.end()) return it->second.get();
+
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(pix_fmt);
+    if (desc == nullptr || av_pix_fmt_count_planes(pix_fmt) != 1 ||
+        av_get_bits_per_pixel(desc) % 8 != 0) {
+        LOG(ERROR) << "FrameCache needs a packed pixel format, not "
+                   << av_get_pix_fmt_name(pix_fmt);
+        return nullptr;
+    }
+    std::unique_ptr<FrameCache> cache(new FrameCache());
+    cache->width_ = width;
+    cache->height_ = height;
+    cache->channels_ = av_get_bits_per_pixel(desc) / 8;
+
+    const auto start = std::chrono::high_resolution_clock::now();
+    const std::string path = cache_dir.empty() ? "" :
+        cache_dir + "/" + CacheFileName(file, pix_fmt, width, height);
+    if (path.empty() || !cache->Map(path)) {
+        if (!cache->Decode(file, format, keep_ar, pix_fmt)) return nullptr;
+        // A cache that cannot be written only costs the next run the decoding.
+        if (!path.empty() && !cache->Save(path)) LOG(WARNING) << "Failed to write " << path;
+    }
+    const std::chrono::duration<double> duration =
+        std::chrono::high_resolution_clock::now() - start;
+    cache->load_secs_ = duration.count();
+    VLOG(1) << (cache->mapped() ? "Mapped " : "Decoded ") << cache->frames_ << " frames of "
+            << file << " in " << cache->load_secs_ * 1000 << " ms.";
+    return (caches[key] = std::move(cache)).get();
+}
+
+FrameCache::~FrameCache() {
+    if (map_ != nullptr) munmap(map_, map_bytes_);
+}
+
+bool FrameCache::Decode(const std::string& file, const char* format, bool keep_ar,
+                        enum AVPixelFormat pix_fmt) {
+    TestVideo video(pix_fmt, width_, height_);
+    if (!video.Init(file, format, keep_ar)) return false;
+    FrameHandle frame;
+    while (video.NextFrame(&frame)) {
+        if (frame->width != width_ || frame->height != height_) {
+            LOG(ERROR) << "Frame " << frames_ << " of " << file << " is " << frame->width << "x"
+                       << frame->height << ", not " << width_ << "x" << height_;
+            return false;
+        }
+        decoded_.resize(frame_bytes() * (frames_ + 1));
+        uint8_t* dst = decoded_.data() + frame_bytes() * frames_;
+        for (int y = 0; y < height_; y++) {
+            memcpy(dst + (size_t)stride() * y, frame->data[0] + (size_t)frame->linesize[0] * y,
+                   stride());
+        }
+        frame.Reset();
+        frames_++;
+    }
+    if (frames_ == 0) {
+        LOG(ERROR) << "No frames in " << file;
+        return false;
+    }
+    data_ = decoded_.data();
+    return true;
+}
+
+bool FrameCache::Map(const std::string& path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < kHeaderBytes) {
+        close(fd);
+        return false;
+    }
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOG(WARNING) << "Failed to map " << path << ": " << strerror(errno);
+        return false;
+    }
+    CacheFileHeader header;
+    memcpy(&header, map, sizeof(header));
+    if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.width != width_ ||
+        header.height != height_ || header.channels != channels_ || header.frames <= 0 ||
+        (size_t)st.st_size != kHeaderBytes + frame_bytes() * header.frames) {
+        LOG(WARNING) << "Ignoring " << path << ", it holds other frames.";
+        munmap(map, st.st_size);
+        return false;
+    }
+    map_ = map;
+    map_bytes_ = st.st_size;
+    frames_ = header.frames;
+    data_ = static_cast<const uint8_t*>(map) + kHeaderBytes;
+    return true;
+}
+
+bool FrameCache::Save(const std::string& path) const {
+    // Written under another name first, so a concurrent or interrupted run never maps half a
+    // file.
+    const std::string tmp_path = Sprintf("%s.%d.tmp", path.c_str(), (int)getpid());
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (file == nullptr) return false;
+    char header[kHeaderBytes] = {};
+    CacheFileHeader fields;
+    memcpy(fields.magic, kMagic, sizeof(kMagic));
+    fields.width = width_;
+    fields.height = height_;
+    fields.channels = channels_;
+    fields.frames = frames_;
+    memcpy(header, &fields, sizeof(fields));
+    fwrite(header, 1, sizeof(header), file);
+    fwrite(data_, 1, frame_bytes() * frames_, file);
+    const bool ok = !ferror(file);
+    if (fclose(file) != 0 || !ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
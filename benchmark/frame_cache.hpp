@@ -0,0 +1,63 @@
+#ifndef FRAME_CACHE_HPP_
+#define FRAME_CACHE_HPP_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "utils.hpp"
+
+// All frames of a short video or image sequence, decoded once and kept packed, so benchmarks can
+// replay them without paying for decoding on every iteration. Optionally the frames are also kept
+// on disk as a raw uint8 NHWC tensor file, which later runs map instead of decoding again.
+class FrameCache {
+  public:
+    // Decodes every frame of |file|, opened as TestVideo::Init does, into |pix_fmt| frames of
+    // |width| x |height|. |pix_fmt| has to be a packed format, e.g. rgb24 or gray8. If
+    // |cache_dir| is not empty the frames are read from or written to a file in it, named after
+    // the source and the frame format; delete it after changing the source. Calls with the same
+    // arguments share one cache, which lives until the process exits. Returns null on failure.
+    static const FrameCache* Load(const std::string& file, const char* format, bool keep_ar,
+                                  enum AVPixelFormat pix_fmt, int width, int height,
+                                  const std::string& cache_dir);
+
+    ~FrameCache();
+
+    int frames() const { return frames_; }
+    int width() const { return width_; }
+    int height() const { return height_; }
+    int channels() const { return channels_; }
+    // Bytes per row, there is no padding.
+    int stride() const { return width_ * channels_; }
+    size_t frame_bytes() const { return (size_t)stride() * height_; }
+    const uint8_t* frame(int index) const { return data_ + frame_bytes() * index; }
+
+    // Whether the frames were mapped from a cache file instead of decoded.
+    bool mapped() const { return map_ != nullptr; }
+    // Time Load took to decode or map the frames.
+    double load_secs() const { return load_secs_; }
+
+  private:
+    FrameCache() {}
+
+    bool Decode(const std::string& file, const char* format, bool keep_ar,
+                enum AVPixelFormat pix_fmt);
+    // Maps |path| if it holds frames of this size. Returns false if it does not exist or does
+    // not match, so the frames have to be decoded.
+    bool Map(const std::string& path);
+    bool Save(const std::string& path) const;
+
+    int frames_ = 0;
+    int width_ = 0;
+    int height_ = 0;
+    int channels_ = 0;
+    const uint8_t* data_ = nullptr;
+    // Either the decoded frames, or the mapping of a cache file.
+    std::vector<uint8_t> decoded_;
+    void* map_ = nullptr;
+    size_t map_bytes_ = 0;
+    double load_secs_ = 0;
+};
+
+#endif  // FRAME_CACHE_HPP_
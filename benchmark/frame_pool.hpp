@@ -0,0 +1,103 @@
+#ifndef FRAME_POOL_HPP_
+#define FRAME_POOL_HPP_
+
+#include <atomic>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "utils.hpp"
+
+class FramePool;
+
+// Owns an AVFrame taken from a FramePool and gives it back on destruction. Move-only. The pool
+// must outlive the handle.
+class FrameHandle {
+  public:
+    FrameHandle() {}
+    FrameHandle(FrameHandle&& other) : pool_(other.pool_), frame_(other.frame_) {
+        other.frame_ = nullptr;
+    }
+    FrameHandle& operator=(FrameHandle&& other) {
+        if (this != &other) {
+            Reset();
+            pool_ = other.pool_;
+            frame_ = other.frame_;
+            other.frame_ = nullptr;
+        }
+        return *this;
+    }
+    FrameHandle(const FrameHandle&) = delete;
+    FrameHandle& operator=(const FrameHandle&) = delete;
+    ~FrameHandle() { Reset(); }
+
+    AVFrame* get() const { return frame_; }
+    AVFrame* operator->() const { return frame_; }
+    explicit operator bool() const { return frame_ != nullptr; }
+
+    // Returns the frame to its pool.
+    inline void Reset();
+
+  private:
+    friend class FramePool;
+    FrameHandle(FramePool* pool, AVFrame* frame) : pool_(pool), frame_(frame) {}
+
+    FramePool* pool_ = nullptr;
+    AVFrame* frame_ = nullptr;
+};
+
+// Recycles AVFrames. A returned frame is unreferenced, which hands its buffers back to the
+// buffer pools of the decoder or filter that made them, and the AVFrame itself is kept for the
+// next Get. Once as many frames as the caller keeps in flight have been allocated, getting and
+// returning frames allocates nothing. Get and returning frames may be called from any thread.
+class FramePool {
+  public:
+    FramePool() {}
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
+    ~FramePool() {
+        for (AVFrame* frame : free_) av_frame_free(&frame);
+    }
+
+    // Returns an empty frame.
+    FrameHandle Get() {
+        AVFrame* frame = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!free_.empty()) {
+                frame = free_.back();
+                free_.pop_back();
+            }
+        }
+        if (frame == nullptr) {
+            frame = av_frame_alloc();
+            allocations_++;
+        }
+        return FrameHandle(this, frame);
+    }
+
+    // Number of AVFrames allocated so far. Stays flat in steady state.
+    int64_t allocations() const { return allocations_; }
+
+  private:
+    friend class FrameHandle;
+
+    void Put(AVFrame* frame) {
+        av_frame_unref(frame);
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.push_back(frame);
+    }
+
+    std::mutex mutex_;
+    std::vector<AVFrame*> free_;
+    std::atomic<int64_t> allocations_{0};
+};
+
+void FrameHandle::Reset() {
+    if (frame_ != nullptr) {
+        pool_->Put(frame_);
+        frame_ = nullptr;
+    }
+}
+
+#endif  // FRAME_POOL_HPP_
@@ -0,0 +1,91 @@
+#ifndef INFERENCE_BACKEND_HPP_
+#define INFERENCE_BACKEND_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "postprocess.hpp"
+
+// How a backend wants the model input laid out, per batch entry.
+struct InputFormat {
+    enum Type {
+        kUInt8,
+        // (v - mean) * scale.
+        kFloat,
+    };
+
+    Type type = kUInt8;
+    // Channel planes (CHW) instead of interleaved channels (HWC). Only for kUInt8.
+    bool planar = false;
+    float mean = 0;
+    float scale = 1;
+};
+
+// An execution context of a backend, with its own input and outputs. Workers of one backend
+// share its model, and different workers may run concurrently on different threads.
+class InferenceWorker {
+  public:
+    virtual ~InferenceWorker() {}
+
+    // Batch entry |batch_index| of the input, InferenceBackend::input_bytes() long.
+    virtual uint8_t* input(int batch_index) = 0;
+    // Runs the first |batch_size| entries of the input.
+    virtual bool Run(int batch_size) = 0;
+    // Starts running the first |batch_size| entries of the input and calls |done| once the outputs
+    // are ready, possibly on another thread. The input and outputs must not be touched until
+    // then. Backends without asynchronous inference run it right away.
+    virtual void StartAsync(int batch_size, std::function<void(bool ok)> done) {
+        done(Run(batch_size));
+    }
+    // Reads the detections of entry |batch_index| out of the outputs of the last Run.
+    virtual void GetDetections(int batch_index, std::vector<Detection>* detections) = 0;
+};
+
+// An inference engine with a loaded object detection model. The pipeline driver, ObjDetector,
+// only talks to this interface, so decoding, batching, pipelining and output are the same for
+// every engine.
+class InferenceBackend {
+  public:
+    virtual ~InferenceBackend() {}
+
+    // Short name of the engine, e.g. "tf".
+    virtual const char* name() const = 0;
+    // Threads a single inference may use, 0 if the engine decides.
+    virtual int threads() const = 0;
+    // Adds the settings of the engine that tell its runs apart, e.g. {"delegate", "xnnpack"}.
+    virtual void GetConfig(std::map<std::string, std::string>* config) const {}
+    // Loads |model|. The input size is the model's own, 0 if it has none, until Reshape.
+    virtual bool Init(const std::string& model) = 0;
+    // Whether Reshape can change the input size. If not, only the batch size can change.
+    virtual bool resizable() const = 0;
+    // Sets the input of the workers created afterwards to |max_batch_size| entries of
+    // width x height. Workers created before must not be used anymore.
+    virtual bool Reshape(int max_batch_size, int width, int height) = 0;
+    virtual bool CreateWorker(std::unique_ptr<InferenceWorker>* worker) = 0;
+
+    const InputFormat& input_format() const { return input_format_; }
+    int max_batch_size() const { return max_batch_size_; }
+    int width() const { return width_; }
+    int height() const { return height_; }
+    int channels() const { return channels_; }
+    // Size in bytes of one batch entry of the input.
+    size_t input_bytes() const {
+        return static_cast<size_t>(width_) * height_ * channels_ *
+               (input_format_.type == InputFormat::kFloat ? sizeof(float) : 1);
+    }
+
+  protected:
+    InputFormat input_format_;
+    int max_batch_size_ = 1;
+    int width_ = 0;
+    int height_ = 0;
+    int channels_ = 3;
+};
+
+#endif  // INFERENCE_BACKEND_HPP_
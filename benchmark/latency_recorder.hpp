@@ -0,0 +1,102 @@
+#ifndef LATENCY_RECORDER_HPP_
+#define LATENCY_RECORDER_HPP_
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <string>
+#include <vector>
+
+// Counts latencies at nanosecond resolution in log-linear buckets, like an HDR histogram. Below
+// 2^kSubBits ns every value has its own bucket. Above, each power of two is split into
+// 2^(kSubBits - 1) buckets, so a percentile is within 1% of the true value at any scale while the
+// recorder stays a fixed 18 KB.
+//
+// Not thread-safe. Give each thread its own recorder and Merge them, or lock around Record.
+class LatencyRecorder {
+  public:
+    LatencyRecorder() : counts_(kNumBuckets, 0) {}
+
+    void Record(int64_t ns) {
+        ns = std::max<int64_t>(ns, 0);
+        counts_[BucketOf(ns)]++;
+        count_++;
+        sum_ns_ += ns;
+        min_ns_ = std::min(min_ns_, ns);
+        max_ns_ = std::max(max_ns_, ns);
+    }
+    template<typename Rep, typename Period>
+    void Record(std::chrono::duration<Rep, Period> duration) {
+        Record(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+    }
+
+    void Merge(const LatencyRecorder& other) {
+        for (int i = 0; i < kNumBuckets; i++) counts_[i] += other.counts_[i];
+        count_ += other.count_;
+        sum_ns_ += other.sum_ns_;
+        min_ns_ = std::min(min_ns_, other.min_ns_);
+        max_ns_ = std::max(max_ns_, other.max_ns_);
+    }
+
+    int64_t count() const { return count_; }
+    double sum_ms() const { return sum_ns_ / 1e6; }
+    double mean_ms() const { return count_ > 0 ? sum_ms() / count_ : 0; }
+    double max_ms() const { return max_ns_ / 1e6; }
+
+    // The |p|th percentile, 0 < p <= 100, by nearest rank. 0 if nothing has been recorded.
+    double PercentileMs(double p) const {
+        if (count_ == 0) return 0;
+        const int64_t rank = std::max<int64_t>(1, ceil(p / 100 * count_));
+        int64_t seen = 0;
+        for (int i = 0; i < kNumBuckets; i++) {
+            seen += counts_[i];
+            if (seen >= rank) return std::max(min_ns_, std::min(BucketValue(i), max_ns_)) / 1e6;
+        }
+        return max_ms();
+    }
+
+    // e.g. "p50 1.23 p95 2.34 p99 3.45 max 4.56 ms".
+    std::string PercentilesString() const {
+        char buf[100];
+        snprintf(buf, sizeof(buf), "p50 %.2f p95 %.2f p99 %.2f max %.2f ms", PercentileMs(50),
+                 PercentileMs(95), PercentileMs(99), max_ms());
+        return buf;
+    }
+
+  private:
+    static const int kSubBits = 7;
+    static const int kSubCount = 1 << kSubBits;
+    static const int kHalfSubCount = kSubCount / 2;
+    // Latencies from 2^kMaxBits ns, about 18 minutes, share the last bucket.
+    static const int kMaxBits = 40;
+    static const int kNumBuckets = kSubCount + (kMaxBits - kSubBits) * kHalfSubCount;
+
+    static int BucketOf(int64_t ns) {
+        if (ns < kSubCount) return ns;
+        // |ns| >> shift is in [kHalfSubCount, kSubCount).
+        const int shift = 63 - __builtin_clzll(ns) - kSubBits + 1;
+        const int bucket =
+            kSubCount + (shift - 1) * kHalfSubCount + static_cast<int>(ns >> shift) - kHalfSubCount;
+        return std::min(bucket, kNumBuckets - 1);
+    }
+
+    // The middle of |bucket|.
+    static int64_t BucketValue(int bucket) {
+        if (bucket < kSubCount) return bucket;
+        const int shift = (bucket - kSubCount) / kHalfSubCount + 1;
+        const int64_t top = (bucket - kSubCount) % kHalfSubCount + kHalfSubCount;
+        return (top << shift) + (int64_t(1) << shift) / 2;
+    }
+
+    std::vector<int64_t> counts_;
+    int64_t count_ = 0;
+    int64_t sum_ns_ = 0;
+    int64_t min_ns_ = std::numeric_limits<int64_t>::max();
+    int64_t max_ns_ = 0;
+};
+
+#endif  // LATENCY_RECORDER_HPP_
@@ -14,6 +14,7 @@
 
 #include <gflags/gflags.h>
 
+#include "results.hpp"
 #include "simple_network.hpp"
 
 DEFINE_int32(neurons, 30, "");
@@ -23,6 +24,8 @@ DEFINE_int32(num_samples_per_epoch, 60000, "");
 DEFINE_double(weight_decay, 1.0, "");
 DEFINE_double(learning_rate, 0.01, "");
 DEFINE_string(data_dir, "", "");
+DEFINE_int32(intra_op_threads, 1, "Threads that a single op may use.");
+DEFINE_int32(inter_op_threads, 1, "Threads that run independent ops.");
 
 namespace {
 
@@ -112,9 +115,29 @@ int main(int argc, char* argv[]) {
     layers.push_back({image_size, SimpleNetwork::ActivationFunc::Identity});
     layers.push_back({FLAGS_neurons, SimpleNetwork::ActivationFunc::Sigmoid});
     layers.push_back({10, SimpleNetwork::ActivationFunc::SoftMax});
-    SimpleNetwork network(layers, FLAGS_mini_batch_size);
+    SimpleNetwork network(layers, FLAGS_mini_batch_size, FLAGS_intra_op_threads,
+                          FLAGS_inter_op_threads);
+    std::vector<SimpleNetwork::EpochStats> epoch_stats;
     network.Train(training_data, FLAGS_num_samples_per_epoch, FLAGS_epochs, FLAGS_weight_decay,
-                  FLAGS_learning_rate, &testing_data);
+                  FLAGS_learning_rate, &testing_data, &epoch_stats);
+    // Every epoch is a repetition of the same benchmark.
+    for (const SimpleNetwork::EpochStats& stats : epoch_stats) {
+        BenchmarkResult result;
+        result.name = "train";
+        result.model = "mnist";
+        result.backend = "tf";
+        result.threads = FLAGS_intra_op_threads;
+        result.batch_size = FLAGS_mini_batch_size;
+        result.config["neurons"] = std::to_string(FLAGS_neurons);
+        result.config["inter_op_threads"] = std::to_string(FLAGS_inter_op_threads);
+        result.frames = stats.train_total;
+        result.wall_secs = stats.secs;
+        result.latency = stats.step_latency;
+        result.counters["train_accuracy"] = (double)stats.train_corrects / stats.train_total;
+        result.counters["accuracy"] = (double)stats.test_corrects / stats.test_total;
+        AddResult(result);
+    }
+    return WriteResults() ? 0 : 1;
 }
 
 /*
@@ -0,0 +1,263 @@
+#ifndef MULTI_STREAM_HPP_
+#define MULTI_STREAM_HPP_
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bounded_queue.hpp"
+
+// Runs many input streams on a fixed pool of workers that share one model.
+//
+// Every stream gets a source thread (decode + preprocess) and a sink thread (annotate + encode).
+// Frames of all streams go through one shared queue to the workers, so a worker may pick up a
+// frame of any stream. The sink of a stream still sees its frames in decode order.
+//
+// With RunBatched, a worker collects frames of any streams into a batch and runs the batch as
+// soon as it is full or its first frame has waited for |max_delay| since its source queued it,
+// whichever comes first. This bounds the latency that batching adds, including the time the frame
+// sat in the queue, and a partial batch at the end of input is never lost.
+template<typename Item>
+class MultiStreamRunner {
+  public:
+    typedef std::unique_ptr<Item> ItemPtr;
+    // Produces the next item of |stream|, or nullptr at its end.
+    typedef std::function<ItemPtr(int stream)> SourceFunc;
+    // Runs |item| on |worker|. Calls with different workers may run concurrently.
+    typedef std::function<bool(int worker, Item* item)> WorkFunc;
+    // Runs a batch of 1 to max_batch_size items on |worker|.
+    typedef std::function<bool(int worker, const std::vector<Item*>& items)> BatchWorkFunc;
+    // Consumes the items of |stream| in the order they were produced.
+    typedef std::function<bool(int stream, Item* item)> SinkFunc;
+    // Takes back an item of |stream| once the sink is done with it.
+    typedef std::function<void(int stream, ItemPtr item)> RecycleFunc;
+
+    struct StreamStats {
+        int frames = 0;
+        double secs = 0;
+    };
+
+    struct WorkerStats {
+        int frames = 0;
+        int batches = 0;
+        // Batches that were run partially filled because their deadline passed.
+        int timed_out_batches = 0;
+        double busy_secs = 0;
+    };
+
+    // |queue_depth| bounds the number of decoded frames waiting for a worker.
+    MultiStreamRunner(int num_streams, int num_workers, size_t queue_depth)
+        : num_streams_(num_streams), num_workers_(num_workers), queue_depth_(queue_depth) {}
+
+    // Items the sink has consumed go to |func| instead of being destroyed, e.g. so the source
+    // can hand them out again.
+    void SetRecycler(RecycleFunc func) { recycle_ = func; }
+
+    // Most items of one stream in flight at once: one in the source, a full queue of tasks, the
+    // batches of all workers and a full queue in front of the sink.
+    size_t max_items_per_stream(int max_batch_size) const {
+        return 1 + 2 * (queue_depth_ + num_workers_ * std::max(1, max_batch_size));
+    }
+
+    // Blocks until every stream has reached its end and all of its frames have been consumed.
+    bool Run(SourceFunc source, WorkFunc work, SinkFunc sink) {
+        return RunBatched(source,
+                          [work](int worker, const std::vector<Item*>& items) {
+                              return work(worker, items[0]);
+                          },
+                          sink, 1, std::chrono::microseconds(0));
+    }
+
+    bool RunBatched(SourceFunc source, BatchWorkFunc work, SinkFunc sink, int max_batch_size,
+                    std::chrono::microseconds max_delay) {
+        source_ = source;
+        work_ = work;
+        sink_ = sink;
+        max_batch_size_ = max_batch_size > 0 ? max_batch_size : 1;
+        max_delay_ = max_delay;
+        failed_ = false;
+        stream_stats_.assign(num_streams_, StreamStats());
+        worker_stats_.assign(num_workers_, WorkerStats());
+        tasks_.reset(new BoundedQueue<Task>(queue_depth_));
+        done_.clear();
+        for (int i = 0; i < num_streams_; i++) {
+            done_.emplace_back(
+                new BoundedQueue<Task>(queue_depth_ + num_workers_ * max_batch_size_));
+        }
+        running_sources_ = num_streams_;
+        running_workers_ = num_workers_;
+
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (int i = 0; i < num_streams_; i++) {
+            threads.emplace_back([this, i] { RunSource(i); });
+            threads.emplace_back([this, i] { RunSink(i); });
+        }
+        for (int i = 0; i < num_workers_; i++) {
+            threads.emplace_back([this, i] { RunWorker(i); });
+        }
+        for (auto& thread : threads) thread.join();
+        wall_secs_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        tasks_.reset();
+        done_.clear();
+        return !failed_;
+    }
+
+    const std::vector<StreamStats>& stream_stats() const { return stream_stats_; }
+    const std::vector<WorkerStats>& worker_stats() const { return worker_stats_; }
+    double wall_secs() const { return wall_secs_; }
+
+    int total_frames() const {
+        int frames = 0;
+        for (const auto& stats : stream_stats_) frames += stats.frames;
+        return frames;
+    }
+
+    // One line per worker with the fraction of wall time it spent running frames.
+    std::string WorkerStatsString() const {
+        std::string result;
+        char line[200];
+        for (int i = 0; i < num_workers_; i++) {
+            const WorkerStats& stats = worker_stats_[i];
+            snprintf(line, sizeof(line), "  worker %-3d %6d frames %8.2f ms/frame %5.1f%% busy",
+                     i, stats.frames, stats.frames > 0 ? stats.busy_secs * 1000 / stats.frames : 0.,
+                     wall_secs_ > 0 ? stats.busy_secs * 100 / wall_secs_ : 0.);
+            result += line;
+            if (max_batch_size_ > 1) {
+                snprintf(line, sizeof(line), " %5.2f frames/batch %d timed out",
+                         stats.batches > 0 ? (double)stats.frames / stats.batches : 0.,
+                         stats.timed_out_batches);
+                result += line;
+            }
+            result += '\n';
+        }
+        return result;
+    }
+
+  private:
+    struct Task {
+        int stream = 0;
+        int64_t seq = 0;
+        ItemPtr item;
+        // When the source queued the item, where its batching delay starts.
+        std::chrono::steady_clock::time_point enqueued;
+    };
+
+    void Abort() {
+        failed_ = true;
+        tasks_->Close();
+        for (auto& done : done_) done->Close();
+    }
+
+    void RunSource(int stream) {
+        int64_t seq = 0;
+        while (!failed_) {
+            ItemPtr item = source_(stream);
+            if (!item) break;
+            Task task;
+            task.stream = stream;
+            task.seq = seq++;
+            task.item = std::move(item);
+            task.enqueued = std::chrono::steady_clock::now();
+            if (!tasks_->Push(std::move(task))) break;
+        }
+        if (--running_sources_ == 0) tasks_->Close();
+    }
+
+    void RunWorker(int worker) {
+        WorkerStats& stats = worker_stats_[worker];
+        std::vector<Task> batch;
+        std::vector<Item*> items;
+        Task task;
+        while (tasks_->Pop(&task)) {
+            if (failed_) continue;
+            batch.clear();
+            batch.push_back(std::move(task));
+            // Wait for more frames until the batch is full or its deadline has passed. The deadline
+            // counts from when the first frame was queued, so time spent waiting for a free
+            // worker is part of it. Frames already queued are still taken once it has passed.
+            const auto deadline = batch[0].enqueued + max_delay_;
+            bool timed_out = false;
+            while (batch.size() < static_cast<size_t>(max_batch_size_)) {
+                const auto status = tasks_->PopUntil(&task, deadline);
+                if (status != BoundedQueue<Task>::kPopped) {
+                    timed_out = status == BoundedQueue<Task>::kTimedOut;
+                    break;
+                }
+                batch.push_back(std::move(task));
+            }
+            items.clear();
+            for (auto& t : batch) items.push_back(t.item.get());
+
+            const auto start = std::chrono::steady_clock::now();
+            const bool ok = work_(worker, items);
+            stats.busy_secs +=
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            stats.frames += batch.size();
+            stats.batches++;
+            if (timed_out) stats.timed_out_batches++;
+            if (!ok) {
+                Abort();
+                continue;
+            }
+            for (auto& t : batch) {
+                const int stream = t.stream;
+                done_[stream]->Push(std::move(t));
+            }
+        }
+        if (--running_workers_ == 0) {
+            for (auto& done : done_) done->Close();
+        }
+    }
+
+    void RunSink(int stream) {
+        const auto start = std::chrono::steady_clock::now();
+        StreamStats& stats = stream_stats_[stream];
+        // Workers finish frames out of order, so hold them back until their turn.
+        std::map<int64_t, ItemPtr> pending;
+        int64_t next_seq = 0;
+        Task task;
+        while (done_[stream]->Pop(&task)) {
+            if (failed_) continue;
+            pending[task.seq] = std::move(task.item);
+            for (auto it = pending.begin(); it != pending.end() && it->first == next_seq;
+                 it = pending.erase(it), next_seq++) {
+                if (!sink_(stream, it->second.get())) {
+                    Abort();
+                    break;
+                }
+                stats.frames++;
+                if (recycle_) recycle_(stream, std::move(it->second));
+            }
+        }
+        stats.secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    const int num_streams_;
+    const int num_workers_;
+    const size_t queue_depth_;
+    SourceFunc source_;
+    BatchWorkFunc work_;
+    SinkFunc sink_;
+    RecycleFunc recycle_;
+    int max_batch_size_ = 1;
+    std::chrono::microseconds max_delay_{0};
+    std::unique_ptr<BoundedQueue<Task>> tasks_;
+    std::vector<std::unique_ptr<BoundedQueue<Task>>> done_;
+    std::atomic<int> running_sources_{0};
+    std::atomic<int> running_workers_{0};
+    std::atomic<bool> failed_{false};
+    std::vector<StreamStats> stream_stats_;
+    std::vector<WorkerStats> worker_stats_;
+    double wall_secs_ = 0;
+};
+
+#endif  // MULTI_STREAM_HPP_
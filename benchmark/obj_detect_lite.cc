@@ -2,12 +2,7 @@
 // https://github.com/tensorflow/examples/blob/master/lite/examples/object_detection/android/app/src/main/java/org/tensorflow/lite/examples/detection/tflite/TFLiteObjectDetectionAPIModel.java
 // if it doesn't work.
 
-#include <math.h>
-#include <stdio.h>
-
-#include <algorithm>
-#include <chrono>
-#include <fstream>
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
@@ -15,46 +10,27 @@
 #include <edgetpu.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
-#include <opencv2/core.hpp>
-#include <opencv2/imgcodecs.hpp>
-#include <opencv2/imgproc.hpp>
 #include <tensorflow/lite/kernels/register.h>
 #include <tensorflow/lite/model.h>
 
-#include "test_video.hpp"
-#include "video_encoder.hpp"
+#include "inference_backend.hpp"
+#include "obj_detect_main.hpp"
+#include "postprocess.hpp"
+#include "tflite_cpu.hpp"
 
 DEFINE_bool(use_edgetpu, false, "");
 DEFINE_string(edgetpu_path, "", "");
 DEFINE_string(model_file, "", "");
 DEFINE_bool(is_quantized_model, false, "");
-DEFINE_string(labels_file, "", "");
-
-DEFINE_string(video_file, "", "");
-DEFINE_string(image_files, "", "Comma separated image files");
-DEFINE_string(output_dir, ".", "");
-DEFINE_bool(output_video, true, "");
-DEFINE_int32(batch_size, 1, "");
-
-DEFINE_int32(ffmpeg_log_level, 8, "");
-DEFINE_int32(run_count, 1, "");
+DEFINE_int32(tflite_threads, 1, "Threads of each interpreter.");
+DEFINE_string(tflite_delegate, "none",
+              "CPU delegate of each interpreter: none for the builtin kernels, or xnnpack.");
 
 namespace {
 
 #define IMAGE_MEAN 128.0f
 #define IMAGE_STD 128.0f
 
-bool ReadLines(const std::string& file_name, std::vector<std::string>* lines) {
-    std::ifstream file(file_name);
-    if (!file) {
-        LOG(ERROR) << "Failed to open file " << file_name;
-        return false;
-    }
-    std::string line;
-    while (std::getline(file, line)) lines->push_back(line);
-    return true;
-}
-
 template<typename T>
 T* TensorData(TfLiteTensor* tensor, int batch_index);
 
@@ -71,45 +47,6 @@ float* TensorData(TfLiteTensor* tensor, int batch_index) {
     return nullptr;
 }
 
-template<>
-uint8_t* TensorData(TfLiteTensor* tensor, int batch_index) {
-    int nelems = 1;
-    for (int i = 1; i < tensor->dims->size; i++) nelems *= tensor->dims->data[i];
-    switch (tensor->type) {
-        case kTfLiteUInt8:
-            return tensor->data.uint8 + nelems * batch_index;
-        default:
-            LOG(FATAL) << "Should not reach here!";
-    }
-    return nullptr;
-}
-
-// Returns a Mat that refer to the data owned by frame.
-std::unique_ptr<cv::Mat> AVFrameToMat(AVFrame* frame) {
-    std::unique_ptr<cv::Mat> mat;
-    if (frame->format == AV_PIX_FMT_RGB24) {
-        mat.reset(new cv::Mat(
-            frame->height, frame->width, CV_8UC3, frame->data[0], frame->linesize[0]));
-        cv::cvtColor(*mat, *mat, cv::COLOR_RGB2BGR);
-    } else if (frame->format == AV_PIX_FMT_GRAY8) {
-        mat.reset(new cv::Mat(
-            frame->height, frame->width, CV_8UC1, frame->data[0], frame->linesize[0]));
-    } else {
-        LOG(FATAL) << "Should not reach here!";
-    }
-    return mat;
-}
-
-struct AVFrameAndMat {
-    ~AVFrameAndMat() {
-        delete mat;
-        av_frame_free(&frame);
-    }
-
-    AVFrame* frame;
-    cv::Mat* mat;
-};
-
 const char* EdgeTpuDeviceTypeStr(edgetpu::DeviceType type) {
     switch (type) {
         case edgetpu::DeviceType::kApexPci:
@@ -120,9 +57,12 @@ const char* EdgeTpuDeviceTypeStr(edgetpu::DeviceType type) {
     return nullptr;
 }
 
-class ObjDetector {
+// Runs a TFLite model on the CPU, or on an EdgeTPU with --use_edgetpu. Every worker has its own
+// interpreter built from the shared model. The input size is fixed by the model.
+class TfliteBackend : public InferenceBackend {
   public:
-    ObjDetector() {
+    TfliteBackend(bool is_quantized, const TfliteCpuOptions& cpu_options)
+        : is_quantized_(is_quantized), cpu_options_(cpu_options) {
         if (FLAGS_use_edgetpu) {
             auto* edgetpu_mgr = edgetpu::EdgeTpuManager::GetSingleton();
             for (const auto& record : edgetpu_mgr->EnumerateEdgeTpu()) {
@@ -143,10 +83,15 @@ class ObjDetector {
                 LOG(FATAL) << "Failed to open edgetpu device!";
             }
         }
-    };
+    }
 
-    bool Init(const std::string& model_file, bool is_quantized,
-              const std::vector<std::string>& labels) {
+    const char* name() const override { return edgetpu_ctx_ ? "edgetpu" : "tflite"; }
+    int threads() const override { return cpu_options_.threads; }
+    void GetConfig(std::map<std::string, std::string>* config) const override {
+        (*config)["delegate"] = TfliteDelegateName(cpu_options_.delegate);
+    }
+
+    bool Init(const std::string& model_file) override {
         // Load model.
         model_ = tflite::FlatBufferModel::BuildFromFile(model_file.c_str());
         if (!model_) {
@@ -155,268 +100,190 @@ class ObjDetector {
         }
 
         // Create interpreter.
-        tflite::ops::builtin::BuiltinOpResolver resolver;
-        if (edgetpu_ctx_) {
-            resolver.AddCustom(edgetpu::kCustomOp, edgetpu::RegisterCustomOp());
-        }
-        tflite::InterpreterBuilder(*model_, resolver)(&interpreter_);
-        if (!interpreter_) {
-            LOG(ERROR) << "Failed to create interpreter!";
-            return false;
-        }
-        if (edgetpu_ctx_) {
-            interpreter_->SetExternalContext(kTfLiteEdgeTpuContext, edgetpu_ctx_.get());
-        }
-
-        if (interpreter_->AllocateTensors() != kTfLiteOk) {
-            LOG(ERROR) << "Failed to allocate tensors!";
-            return false;
-        }
-        interpreter_->SetNumThreads(1);
+        if (!CreateInterpreter(0, &interpreter_)) return false;
 
         // Find input tensors.
         if (interpreter_->inputs().size() != 1) {
             LOG(ERROR) << "Graph needs to have 1 and only 1 input!";
             return false;
         }
-        input_tensor_ = interpreter_->tensor(interpreter_->inputs()[0]);
-        if (is_quantized) {
-            if (input_tensor_->type != kTfLiteUInt8) {
+        const TfLiteTensor* input_tensor = interpreter_->tensor(interpreter_->inputs()[0]);
+        if (is_quantized_) {
+            if (input_tensor->type != kTfLiteUInt8) {
                 LOG(ERROR) << "Quantized graph's input should be kTfLiteUInt8!";
                 return false;
             }
+            input_format_.type = InputFormat::kUInt8;
         } else {
-            if (input_tensor_->type != kTfLiteFloat32) {
-                LOG(ERROR) << "Quantized graph's input should be kTfLiteFloat32!";
+            if (input_tensor->type != kTfLiteFloat32) {
+                LOG(ERROR) << "Float graph's input should be kTfLiteFloat32!";
                 return false;
             }
+            input_format_.type = InputFormat::kFloat;
+            input_format_.mean = IMAGE_MEAN;
+            input_format_.scale = 1 / IMAGE_STD;
         }
-
-        // Find output tensors.
-        if (interpreter_->outputs().size() != 4) {
-            LOG(ERROR) << "Graph needs to have 4 and only 4 outputs!";
+        max_batch_size_ = model_batch_size_ = input_tensor->dims->data[0];
+        height_ = input_tensor->dims->data[1];
+        width_ = input_tensor->dims->data[2];
+        channels_ = input_tensor->dims->data[3];
+
+        // Find output tensors: boxes, classes, scores and count from
+        // TFLite_Detection_PostProcess, or the raw box encodings and class predictions of an SSD
+        // exported without it, which are decoded here.
+        const std::vector<int>& outputs = interpreter_->outputs();
+        if (outputs.size() == 2) {
+            if (!InitSsdDecoder()) return false;
+        } else if (outputs.size() != 4) {
+            LOG(ERROR) << "Graph needs to have 4 outputs, or 2 without post-processing!";
             return false;
         }
-        output_locations_ = interpreter_->tensor(interpreter_->outputs()[0]);
-        output_classes_ = interpreter_->tensor(interpreter_->outputs()[1]);
-        output_scores_ = interpreter_->tensor(interpreter_->outputs()[2]);
-        num_detections_ = interpreter_->tensor(interpreter_->outputs()[3]);
+        return true;
+    }
+
+    bool resizable() const override { return false; }
 
-        labels_ = labels;
+    // Only the batch size can change. Interpreters are resized to it when they are created.
+    bool Reshape(int max_batch_size, int width, int height) override {
+        max_batch_size_ = max_batch_size;
         return true;
     }
 
+    bool CreateWorker(std::unique_ptr<InferenceWorker>* worker) override;
 
-    bool RunVideo(const std::string& video_file, int batch_size,
-                  const std::string& output_name, bool output_video) {
-        // Open input video.
-        TestVideo test_video(decode_pix_fmt(), 0, 0);
-        if (!test_video.Init(video_file, nullptr, true)) {
-            return false;
+    // Reads the detections of one batch entry out of the outputs of |interpreter|.
+    void GetDetections(tflite::Interpreter* interpreter, int batch_index,
+                       std::vector<Detection>* detections) const {
+        const std::vector<int>& outputs = interpreter->outputs();
+        if (ssd_decoder_ != nullptr) {
+            ssd_decoder_->Decode(TensorData<float>(interpreter->tensor(outputs[0]), batch_index),
+                                 TensorData<float>(interpreter->tensor(outputs[1]), batch_index),
+                                 detections);
+        } else {
+            const int num_detections =
+                *TensorData<float>(interpreter->tensor(outputs[3]), batch_index);
+            FilterDetections(TensorData<float>(interpreter->tensor(outputs[0]), batch_index),
+                             TensorData<float>(interpreter->tensor(outputs[1]), batch_index),
+                             TensorData<float>(interpreter->tensor(outputs[2]), batch_index),
+                             num_detections, 0, postprocess_options_, detections);
         }
+        VLOG(1) << detections->size() << " detections";
+    }
 
-        // Open output video if needed.
-        AVFrame* encode_frame = nullptr;
-        std::unique_ptr<VideoEncoder> video_encoder;
-        if (output_video) {
-            video_encoder.reset(new VideoEncoder);
-            enum AVPixelFormat pix_fmt = encode_pix_fmt();
-            if (!video_encoder->Init(pix_fmt, test_video.width(), test_video.height(),
-                                     test_video.time_base(), output_name)) {
-                return false;
-            }
-            encode_frame = av_frame_alloc();
-            encode_frame->width = test_video.width();
-            encode_frame->height = test_video.height();
-            encode_frame->format = pix_fmt;
-            av_frame_get_buffer(encode_frame, 0);
+  private:
+    // Builds an interpreter of the model. A |batch_size| > 0 resizes its input to that many
+    // entries first.
+    bool CreateInterpreter(int batch_size, std::unique_ptr<tflite::Interpreter>* interpreter) {
+        tflite::ops::builtin::BuiltinOpResolver resolver;
+        if (edgetpu_ctx_) {
+            resolver.AddCustom(edgetpu::kCustomOp, edgetpu::RegisterCustomOp());
         }
-
-        // Run.
-        int frames = 0;
-        int total_ms = 0;
-        AVFrame* frame = nullptr;
-        std::vector<std::unique_ptr<AVFrameAndMat>> batch(batch_size);
-        while ((frame = test_video.NextFrame())) {
-            // Feed in data.
-            auto mat = AVFrameToMat(frame);
-            const int batch_index = frames % batch_size;
-            if (width() != mat->cols || height() != mat->rows) {
-                cv::Mat for_tf;
-                cv::resize(*mat, for_tf, cv::Size(width(), height()));
-                FeedInMat(for_tf, batch_index);
-            } else {
-                FeedInMat(*mat, batch_index);
-            }
-            batch[batch_index].reset(new AVFrameAndMat{frame, mat.release()});
-            frames++;
-            if (frames % batch_size != 0) continue;
-
-            // Run.
-            const auto start = std::chrono::high_resolution_clock::now();
-            if (interpreter_->Invoke() != kTfLiteOk) return false;
-            const std::chrono::duration<double> duration =
-                std::chrono::high_resolution_clock::now() - start;
-            const auto elapsed_ms =
-                std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
-            total_ms += elapsed_ms;
-            VLOG(0) << frames << ": ms=" << elapsed_ms;
-
-            // Annotate.
-            if (input_channels() == 3) {
-                for (auto& f : batch) cv::cvtColor(*f->mat, *f->mat, cv::COLOR_RGB2BGR);
-            }
-            for (int i = 0; i < batch_size; i++) {
-                AnnotateMat(*batch[i]->mat, i);
-            }
-            if (output_video) {
-                for (int i = 0; i < batch_size; i++) {
-                    const auto* mat = batch[i]->mat;
-                    uint8_t* dst = encode_frame->data[0];
-                    for (int row = 0; row < mat->rows; row++) {
-                        memcpy(dst, mat->ptr(row), mat->cols * input_channels());
-                        dst += encode_frame->linesize[0];
-                    }
-                    encode_frame->pts = batch[i]->frame->pts;
-                    video_encoder->EncodeAVFrame(encode_frame);
-                }
-            } else {
-                char image_file_name[1000];
-                for (int i = 0; i < batch_size; i++) {
-                    snprintf(image_file_name, sizeof(image_file_name), "%s.%05d.jpeg",
-                             output_name.c_str(), frames - batch_size + i);
-                    cv::imwrite(image_file_name, *batch[i]->mat);
+        tflite::InterpreterBuilder(*model_, resolver)(interpreter);
+        if (!*interpreter) {
+            LOG(ERROR) << "Failed to create interpreter!";
+            return false;
+        }
+        if (edgetpu_ctx_) {
+            (*interpreter)->SetExternalContext(kTfLiteEdgeTpuContext, edgetpu_ctx_.get());
+        }
+        if (batch_size > 0) {
+            const int input = (*interpreter)->inputs()[0];
+            const TfLiteIntArray* dims = (*interpreter)->tensor(input)->dims;
+            if (dims->data[0] != batch_size) {
+                std::vector<int> shape(dims->data, dims->data + dims->size);
+                shape[0] = batch_size;
+                if ((*interpreter)->ResizeInputTensor(input, shape) != kTfLiteOk) {
+                    LOG(ERROR) << "Failed to resize the input to a batch of " << batch_size;
+                    return false;
                 }
             }
         }
-        av_frame_free(&encode_frame);
-        printf("%s: %d %dx%d frames processed in %d ms(%d mspf).\n",
-               output_name.c_str(), frames, width(), height(), total_ms, total_ms / frames);
-        return true;
+
+        if ((*interpreter)->AllocateTensors() != kTfLiteOk) {
+            LOG(ERROR) << "Failed to allocate tensors!";
+            return false;
+        }
+        return ApplyTfliteCpuOptions(cpu_options_, interpreter->get());
     }
 
-    bool RunImage(const std::string file_name, const std::string& output) {
-        cv::Mat mat = cv::imread(file_name);
-        if (!mat.data) {
-            LOG(ERROR) << "Failed to read image " << file_name;
+    // Sets up decoding for a model with the raw SSD outputs [1, anchors, 4] and
+    // [1, anchors, classes], using the default SSD anchors for the input size.
+    bool InitSsdDecoder() {
+        const std::vector<int>& outputs = interpreter_->outputs();
+        const TfLiteTensor* boxes = interpreter_->tensor(outputs[0]);
+        const TfLiteTensor* classes = interpreter_->tensor(outputs[1]);
+        if (boxes->type != kTfLiteFloat32 || classes->type != kTfLiteFloat32 ||
+            boxes->dims->size != 3 || classes->dims->size != 3 || boxes->dims->data[2] != 4) {
+            LOG(ERROR) << "Raw SSD outputs need to be float [1, anchors, 4] and "
+                       << "[1, anchors, classes]!";
             return false;
         }
-        if (width() != mat.cols || height() != mat.rows) {
-            cv::Mat resized;
-            cv::resize(mat, resized, cv::Size(width(), height()));
-            cv::cvtColor(resized, resized, cv::COLOR_BGR2RGB);
-            FeedInMat(resized, 0);
-        } else {
-            cv::Mat for_tf;
-            cv::cvtColor(mat, for_tf, cv::COLOR_BGR2RGB);
-            FeedInMat(for_tf, 0);
+        SsdAnchorOptions anchor_options;
+        anchor_options.input_width = width_;
+        anchor_options.input_height = height_;
+        const std::vector<Anchor> anchors = GenerateSsdAnchors(anchor_options);
+        if (boxes->dims->data[1] != static_cast<int>(anchors.size()) ||
+            classes->dims->data[1] != static_cast<int>(anchors.size())) {
+            LOG(ERROR) << "Graph has " << boxes->dims->data[1] << " anchors, expected "
+                       << anchors.size();
+            return false;
         }
-        if (interpreter_->Invoke() != kTfLiteOk) return false;
-        AnnotateMat(mat, 0);
-        cv::imwrite(output, mat);
+        ssd_decoder_.reset(new SsdDecoder(anchors, classes->dims->data[2], postprocess_options_));
         return true;
     }
 
-  private:
-    int width() const {
-        return input_tensor_->dims->data[2];
-    }
-
-    int height() const {
-        return input_tensor_->dims->data[1];
-    }
+    const bool is_quantized_;
+    const TfliteCpuOptions cpu_options_;
+    std::shared_ptr<edgetpu::EdgeTpuContext> edgetpu_ctx_;
+    std::unique_ptr<tflite::FlatBufferModel> model_;
+    // Built by Init, and handed to the first worker with the batch size of the model.
+    std::unique_ptr<tflite::Interpreter> interpreter_;
+    int model_batch_size_ = 1;
 
-    int input_channels() const {
-        return input_tensor_->dims->data[3];
-    }
+    const PostprocessOptions postprocess_options_ = GetPostprocessOptions();
+    // Only for models without TFLite_Detection_PostProcess.
+    std::unique_ptr<SsdDecoder> ssd_decoder_;
+};
 
-    enum AVPixelFormat decode_pix_fmt() const {
-        return input_channels() == 3 ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_GRAY8;
-    }
+class TfliteWorker : public InferenceWorker {
+  public:
+    TfliteWorker(const TfliteBackend* backend, std::unique_ptr<tflite::Interpreter> interpreter)
+        : backend_(backend), interpreter_(std::move(interpreter)),
+          input_(interpreter_->tensor(interpreter_->inputs()[0])) {}
 
-    enum AVPixelFormat encode_pix_fmt() const {
-        return input_channels() == 3 ? AV_PIX_FMT_BGR24 : AV_PIX_FMT_GRAY8;
+    uint8_t* input(int batch_index) override {
+        return reinterpret_cast<uint8_t*>(input_->data.raw) +
+               batch_index * backend_->input_bytes();
     }
 
-    void FeedInMat(const cv::Mat& mat, int batch_index) {
-        switch (input_tensor_->type) {
-            case kTfLiteFloat32:
-                {
-                    float* dst = TensorData<float>(input_tensor_, batch_index);
-                    const int row_elems = width() * input_channels();
-                    for (int row = 0; row < height(); row++) {
-                        const uchar* row_ptr = mat.ptr(row);
-                        for (int i = 0; i < row_elems; i++) {
-                            dst[i] = (row_ptr[i] - IMAGE_MEAN) / IMAGE_STD;
-                        }
-                        dst += row_elems;
-                    }
-                }
-                break;
-            case kTfLiteUInt8:
-                {
-                    uint8_t* dst = TensorData<uint8_t>(input_tensor_, batch_index);
-                    const int row_elems = width() * input_channels();
-                    for (int row = 0; row < height(); row++) {
-                        memcpy(dst, mat.ptr(row), row_elems);
-                        dst += row_elems;
-                    }
-                }
-                break;
-            default:
-                LOG(FATAL) << "Should not reach here!";
+    // The interpreter always runs its whole batch, the entries after |batch_size| are ignored.
+    bool Run(int batch_size) override {
+        if (interpreter_->Invoke() != kTfLiteOk) {
+            LOG(ERROR) << "Failed to invoke interpreter!";
+            return false;
         }
+        return true;
     }
 
-    void AnnotateMat(cv::Mat& mat, int batch_index) {
-        const float* detection_locations = TensorData<float>(output_locations_, batch_index);
-        const float* detection_classes = TensorData<float>(output_classes_, batch_index);
-        const float* detection_scores = TensorData<float>(output_scores_, batch_index);
-        const int num_detections = *TensorData<float>(num_detections_, batch_index);
-        for (int d = 0; d < num_detections; d++) {
-            const std::string cls = labels_[detection_classes[d]];
-            const float score = detection_scores[d];
-            const int ymin = detection_locations[4 * d] * mat.rows;
-            const int xmin = detection_locations[4 * d + 1] * mat.cols;
-            const int ymax = detection_locations[4 * d + 2] * mat.rows;
-            const int xmax = detection_locations[4 * d + 3] * mat.cols;
-            if (score < .3f) {
-                VLOG(3) << "Ignore detection " << d << " of '" << cls << "' with score " << score
-                    << " @[" << xmin << "," << ymin << ":" << xmax << "," << ymax << "]";
-            } else {
-                VLOG(0) << "Detected " << d << " of '" << cls << "' with score " << score
-                    << " @[" << xmin << "," << ymin << ":" << xmax << "," << ymax << "]";
-                cv::rectangle(mat, cv::Rect(xmin, ymin, xmax - xmin, ymax - ymin),
-                              cv::Scalar(0, 0, 255), 1);
-                cv::putText(mat, cls, cv::Point(xmin, ymin - 5),
-                            cv::FONT_HERSHEY_COMPLEX, .8, cv::Scalar(10, 255, 30));
-            }
-        }
+    void GetDetections(int batch_index, std::vector<Detection>* detections) override {
+        backend_->GetDetections(interpreter_.get(), batch_index, detections);
     }
 
-    std::shared_ptr<edgetpu::EdgeTpuContext> edgetpu_ctx_;
-    std::unique_ptr<tflite::FlatBufferModel> model_;
-    std::unique_ptr<tflite::Interpreter> interpreter_;
-    std::vector<std::string> labels_;
-
-    TfLiteTensor* input_tensor_ = nullptr;
-    TfLiteTensor* output_locations_ = nullptr;
-    TfLiteTensor* output_classes_ = nullptr;
-    TfLiteTensor* output_scores_ = nullptr;
-    TfLiteTensor* num_detections_ = nullptr;
+  private:
+    const TfliteBackend* const backend_;
+    const std::unique_ptr<tflite::Interpreter> interpreter_;
+    TfLiteTensor* const input_;
 };
 
-std::vector<std::string> split(const std::string& s, char delimiter) {
-    std::vector<std::string> tokens;
-    std::string token;
-    std::istringstream token_stream(s);
-    while (std::getline(token_stream, token, delimiter)) tokens.push_back(token);
-    return tokens;
-}
-
-std::string filename_base(const std::string& filename) {
-    std::string filename_copy(filename);
-    return basename(filename_copy.data());
+bool TfliteBackend::CreateWorker(std::unique_ptr<InferenceWorker>* worker) {
+    std::unique_ptr<tflite::Interpreter> interpreter;
+    if (interpreter_ && max_batch_size_ == model_batch_size_) {
+        interpreter = std::move(interpreter_);
+    } else if (!CreateInterpreter(max_batch_size_, &interpreter)) {
+        return false;
+    }
+    worker->reset(new TfliteWorker(this, std::move(interpreter)));
+    return true;
 }
 
 }  // namespace
@@ -424,24 +291,14 @@ std::string filename_base(const std::string& filename) {
 int main(int argc, char** argv) {
     google::SetCommandLineOption("v", "1");
     google::SetCommandLineOption("logtostderr", "1");
+    google::SetCommandLineOptionWithMode("score_threshold", "0.3", google::SET_FLAGS_DEFAULT);
     google::ParseCommandLineFlags(&argc, &argv, true);
     google::InitGoogleLogging(argv[0]);
-    InitFfmpeg(FLAGS_ffmpeg_log_level);
-    std::vector<std::string> labels;
-    if (!ReadLines(FLAGS_labels_file, &labels)) return 1;
-    ObjDetector obj_detector;
-    if (!obj_detector.Init(FLAGS_model_file, FLAGS_is_quantized_model, labels)) return 1;
-    for (int i = 0; i < FLAGS_run_count; i++) {
-        if (!FLAGS_video_file.empty()) {
-            obj_detector.RunVideo(FLAGS_video_file, FLAGS_batch_size,
-                                  FLAGS_output_dir + "/" + filename_base(FLAGS_video_file),
-                                  FLAGS_output_video);
-        } else if (!FLAGS_image_files.empty()) {
-            for (const std::string& img_file : split(FLAGS_image_files, ',')) {
-                obj_detector.RunImage(img_file, FLAGS_output_dir + "/" + filename_base(img_file));
-            }
-        }
-    }
+    TfliteCpuOptions cpu_options;
+    cpu_options.threads = FLAGS_tflite_threads;
+    if (!ParseTfliteDelegate(FLAGS_tflite_delegate, &cpu_options.delegate)) return 1;
+    TfliteBackend backend(FLAGS_is_quantized_model, cpu_options);
+    return RunObjDetect(&backend, FLAGS_model_file);
 }
 
 /*
@@ -0,0 +1,203 @@
+#include "obj_detect_main.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "obj_detector.hpp"
+#include "results.hpp"
+#include "utils.hpp"
+
+DEFINE_string(labels_file, "", "");
+
+DEFINE_string(video_file, "", "");
+DEFINE_string(video_files, "",
+              "Comma separated video files, processed concurrently as separate streams that "
+              "share one model.");
+DEFINE_int32(num_workers, 1,
+             "Number of inference workers shared by all --video_files. Each worker has its own "
+             "input and outputs, e.g. its own interpreter or infer request.");
+DEFINE_string(image_files, "", "Comma separated image files");
+DEFINE_int32(width, 300, "Model input width. Ignored by models with a fixed input size.");
+DEFINE_int32(height, 300, "Model input height. Ignored by models with a fixed input size.");
+DEFINE_string(input_buckets, "",
+              "Comma separated WxH input sizes, e.g. 320x320,640x640. Images are letterboxed into "
+              "the smallest that holds them, so mixed image sizes reuse a few compiled shapes.");
+DEFINE_string(output_dir, ".", "");
+DEFINE_bool(output_video, true, "");
+DEFINE_string(output, "",
+              "What to write for a video: video, jpeg, jsonl, binary or none. Empty for video or "
+              "jpeg, following --output_video.");
+DEFINE_int32(batch_size, 1, "");
+DEFINE_double(batch_timeout_ms, 15,
+              "With --video_files, run a partial batch once its first frame has waited this long "
+              "since it was decoded and queued.");
+DEFINE_int32(pipeline_depth, 0,
+             "If > 0, run decode/preprocess/infer/annotate/encode on separate threads, "
+             "with at most this many frames queued between two stages.");
+DEFINE_int32(nireq, 0,
+             "If > 0, keep this many inference requests in flight, overlapping decode and "
+             "output with inference. Only OpenVINO runs them asynchronously.");
+DEFINE_int32(segments, 1,
+             "If > 1, cut --video_file at keyframes into this many parts and process them in "
+             "parallel.");
+DEFINE_bool(decode_yuv, false,
+            "Keep decoded frames in YUV 4:2:0 and convert to RGB while resizing to the model "
+            "input. Full frames are converted only for the annotated output.");
+DEFINE_int32(decode_threads, 1, "Decoder threads, 0 for one per core.");
+DEFINE_string(decode_thread_type, "auto", "Decoder threading: frame, slice or auto.");
+DEFINE_int32(filter_threads, 1, "Threads of the filter graph that scales and converts frames.");
+DEFINE_bool(keyframes_only, false, "Only decode and process keyframes.");
+DEFINE_int32(every_nth_frame, 1, "Only process every Nth decoded frame.");
+DEFINE_double(target_fps, 0, "If > 0, only process about this many frames per second of video.");
+DEFINE_string(encode_preset, "fast", "x264 preset of the output video, e.g. ultrafast.");
+DEFINE_string(encode_tune, "", "x264 tune of the output video, e.g. zerolatency.");
+DEFINE_int64(encode_bitrate, 0, "If > 0, encode at this average bitrate, in bits per second.");
+DEFINE_double(encode_crf, -1,
+              "If >= 0 and there is no --encode_bitrate, encode at this constant quality.");
+DEFINE_int32(encode_qp, 20, "Constant quantizer if neither --encode_bitrate nor --encode_crf.");
+DEFINE_int32(encode_threads, 1, "Encoder threads, 0 for one per core.");
+DEFINE_string(output_container, "matroska",
+              "Format of the output video, empty to guess it from the file name.");
+
+DEFINE_double(score_threshold, .51, "Detections scored below this are dropped.");
+DEFINE_int32(top_k, 100, "Detections kept per frame, the highest scored first. 0 for all.");
+DEFINE_double(nms_iou_threshold, .6,
+              "For models without in-graph post-processing: overlap above which the lower "
+              "scored of two detections of a class is dropped.");
+DEFINE_int32(max_detections, 100,
+             "For models without in-graph post-processing: detections kept after NMS.");
+
+DEFINE_int32(ffmpeg_log_level, 8, "");
+DEFINE_int32(run_count, 1, "");
+
+namespace {
+
+bool ReadLines(const std::string& file_name, std::vector<std::string>* lines) {
+    std::ifstream file(file_name);
+    if (!file) {
+        LOG(ERROR) << "Failed to open file " << file_name;
+        return false;
+    }
+    std::string line;
+    while (std::getline(file, line)) lines->push_back(line);
+    return true;
+}
+
+std::vector<std::string> split(const std::string& s, char delimiter) {
+    std::vector<std::string> tokens;
+    std::string token;
+    std::istringstream token_stream(s);
+    while (std::getline(token_stream, token, delimiter)) tokens.push_back(token);
+    return tokens;
+}
+
+std::string filename_base(const std::string& filename) {
+    std::string filename_copy(filename);
+    return basename(filename_copy.data());
+}
+
+// Decoder settings from the command line.
+DecodeOptions GetDecodeOptions() {
+    DecodeOptions options;
+    options.threads = FLAGS_decode_threads;
+    options.thread_type = FLAGS_decode_thread_type;
+    options.filter_threads = FLAGS_filter_threads;
+    options.keyframes_only = FLAGS_keyframes_only;
+    options.every_nth = FLAGS_every_nth_frame;
+    options.target_fps = FLAGS_target_fps;
+    return options;
+}
+
+EncoderOptions GetEncoderOptions() {
+    EncoderOptions options;
+    options.preset = FLAGS_encode_preset;
+    options.tune = FLAGS_encode_tune;
+    options.bitrate = FLAGS_encode_bitrate;
+    options.crf = FLAGS_encode_crf;
+    options.qp = FLAGS_encode_qp;
+    options.threads = FLAGS_encode_threads;
+    options.container = FLAGS_output_container;
+    return options;
+}
+
+bool GetOutputType(OutputType* type) {
+    if (FLAGS_output.empty()) {
+        *type = FLAGS_output_video ? OutputType::kVideo : OutputType::kJpeg;
+        return true;
+    }
+    return ParseOutputType(FLAGS_output, type);
+}
+
+bool ParseInputBuckets(const std::string& value, std::vector<cv::Size>* buckets) {
+    for (const std::string& bucket : split(value, ',')) {
+        int width = 0, height = 0;
+        char end;
+        if (sscanf(bucket.c_str(), "%dx%d%c", &width, &height, &end) != 2 || width <= 0 ||
+            height <= 0) {
+            LOG(ERROR) << "Invalid input bucket '" << bucket << "', expected WxH";
+            return false;
+        }
+        buckets->emplace_back(width, height);
+    }
+    return true;
+}
+
+}  // namespace
+
+PostprocessOptions GetPostprocessOptions() {
+    PostprocessOptions options;
+    options.score_threshold = FLAGS_score_threshold;
+    options.top_k = FLAGS_top_k;
+    options.iou_threshold = FLAGS_nms_iou_threshold;
+    options.max_detections = FLAGS_max_detections;
+    return options;
+}
+
+int RunObjDetect(InferenceBackend* backend, const std::string& model) {
+    InitFfmpeg(FLAGS_ffmpeg_log_level);
+    std::vector<std::string> labels;
+    if (!ReadLines(FLAGS_labels_file, &labels)) return 1;
+    if (!backend->Init(model)) return 1;
+    LOG(INFO) << "Running " << model << " on " << backend->name();
+    ObjDetectorOptions options;
+    options.decode = GetDecodeOptions();
+    options.encoder = GetEncoderOptions();
+    options.decode_yuv = FLAGS_decode_yuv;
+    if (!GetOutputType(&options.output_type)) return 1;
+    if (!ParseInputBuckets(FLAGS_input_buckets, &options.input_buckets)) return 1;
+    ObjDetector obj_detector(backend, labels, options);
+    for (int i = 0; i < FLAGS_run_count; i++) {
+        if (!FLAGS_video_files.empty()) {
+            const auto video_files = split(FLAGS_video_files, ',');
+            std::vector<std::string> output_names;
+            for (size_t j = 0; j < video_files.size(); j++) {
+                output_names.push_back(Sprintf("%s/%d_%s", FLAGS_output_dir.c_str(), (int)j,
+                                               filename_base(video_files[j]).c_str()));
+            }
+            obj_detector.RunStreams(video_files, FLAGS_width, FLAGS_height, FLAGS_num_workers,
+                                    FLAGS_batch_size, FLAGS_batch_timeout_ms, output_names);
+        } else if (!FLAGS_video_file.empty()) {
+            obj_detector.RunVideo(FLAGS_video_file, FLAGS_width, FLAGS_height, FLAGS_batch_size,
+                                  FLAGS_pipeline_depth, FLAGS_nireq, FLAGS_segments,
+                                  FLAGS_output_dir + "/" + filename_base(FLAGS_video_file));
+        } else if (!FLAGS_image_files.empty()) {
+            for (const std::string& img_file : split(FLAGS_image_files, ',')) {
+                obj_detector.RunImage(img_file, FLAGS_width, FLAGS_height,
+                                      FLAGS_output_dir + "/" + filename_base(img_file));
+            }
+        }
+    }
+    for (BenchmarkResult result : obj_detector.results()) {
+        result.model = filename_base(model);
+        result.threads = backend->threads();
+        backend->GetConfig(&result.config);
+        AddResult(result);
+    }
+    return WriteResults() ? 0 : 1;
+}
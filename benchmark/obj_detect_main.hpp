@@ -0,0 +1,24 @@
+#ifndef OBJ_DETECT_MAIN_HPP_
+#define OBJ_DETECT_MAIN_HPP_
+
+#include <string>
+
+#include <gflags/gflags.h>
+
+#include "inference_backend.hpp"
+#include "postprocess.hpp"
+
+// The command line shared by obj_detect, obj_detect_lite and obj_detect_dldt. Their own files
+// only define the flags of their engine, build its backend and call RunObjDetect.
+
+DECLARE_int32(num_workers);
+DECLARE_int32(segments);
+
+// Post-processing settings from the command line.
+PostprocessOptions GetPostprocessOptions();
+
+// Loads |model| into |backend| and runs the videos or images given on the command line through
+// it. Returns the exit code of main.
+int RunObjDetect(InferenceBackend* backend, const std::string& model);
+
+#endif  // OBJ_DETECT_MAIN_HPP_
@@ -0,0 +1,791 @@
+#include "obj_detector.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <thread>
+
+#include <glog/logging.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include "bounded_queue.hpp"
+#include "multi_stream.hpp"
+#include "pipeline.hpp"
+
+namespace {
+
+bool IsYuv420(const AVFrame* frame) {
+    return frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUVJ420P;
+}
+
+// Describes the decoded frame for InputResizer.
+SourceImage AVFrameToSource(const AVFrame* frame) {
+    if (IsYuv420(frame)) {
+        return SourceImage::Yuv420(frame->data, frame->linesize,
+                                   frame->format == AV_PIX_FMT_YUVJ420P ||
+                                       frame->color_range == AVCOL_RANGE_JPEG);
+    }
+    return SourceImage::Packed(frame->data[0], frame->linesize[0], false);
+}
+
+// Points |mat| at the data owned by frame. RGB frames are converted to BGR in place, so feed the
+// frame to the model first. YUV frames are converted into the buffer of |mat|, which is reused
+// if it already has the right size.
+void AVFrameToMat(AVFrame* frame, cv::Mat* mat) {
+    if (IsYuv420(frame)) {
+        mat->create(frame->height, frame->width, CV_8UC3);
+        Yuv420ToPacked(AVFrameToSource(frame), mat->cols, mat->rows, true, mat->data, mat->step);
+    } else if (frame->format == AV_PIX_FMT_RGB24) {
+        *mat = cv::Mat(frame->height, frame->width, CV_8UC3, frame->data[0], frame->linesize[0]);
+        SwapRB(mat->data, mat->step, mat->cols, mat->rows, mat->data, mat->step);
+    } else if (frame->format == AV_PIX_FMT_GRAY8) {
+        *mat = cv::Mat(frame->height, frame->width, CV_8UC1, frame->data[0], frame->linesize[0]);
+    } else {
+        LOG(FATAL) << "Should not reach here!";
+    }
+}
+
+double ToMs(std::chrono::nanoseconds duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+double ElapsedSecs(std::chrono::high_resolution_clock::time_point start) {
+    const std::chrono::duration<double> duration =
+        std::chrono::high_resolution_clock::now() - start;
+    return duration.count();
+}
+
+std::string BaseName(const std::string& path) {
+    const size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+// A slot of the batch in RunVideo. Slots are reused, so are their frames and Mats.
+struct BatchFrame {
+    FrameHandle frame;
+    cv::Mat mat;
+};
+
+// A free list of items, e.g. the PipelineFrames of the pipelined runs, so every frame reuses the
+// buffers of one that is done instead of allocating its own. Get only allocates while more items
+// are in flight than ever before, and Put drops what does not fit into |capacity|, so neither
+// waits and a failed run cannot get stuck on an empty list. Thread-safe.
+template<typename Item>
+class ItemPool {
+  public:
+    explicit ItemPool(size_t capacity) : free_(capacity) {}
+
+    std::unique_ptr<Item> Get() {
+        std::unique_ptr<Item> item;
+        if (!free_.TryPop(&item)) {
+            item.reset(new Item);
+            allocations_++;
+        }
+        return item;
+    }
+
+    void Put(std::unique_ptr<Item> item) { free_.TryPush(std::move(item)); }
+
+    // Items allocated so far. Stays flat in steady state.
+    int64_t allocations() const { return allocations_; }
+
+  private:
+    BoundedQueue<std::unique_ptr<Item>> free_;
+    std::atomic<int64_t> allocations_{0};
+};
+
+}  // namespace
+
+// A frame travelling through the RunVideo pipeline or RunStreams. A worker owns a single input,
+// so each frame keeps its own copy of it, and the detections are read out of the worker right
+// after inference. Frames are recycled through an ItemPool, so are their input and Mat.
+struct ObjDetector::PipelineFrame {
+    int index = 0;
+    FrameHandle frame;
+    std::vector<Detection> detections;
+    // Only made if the output wants images.
+    cv::Mat mat;
+    std::vector<uint8_t> input;
+};
+
+ObjDetector::ObjDetector(InferenceBackend* backend, const std::vector<std::string>& labels,
+                         const ObjDetectorOptions& options)
+    : backend_(backend), labels_(labels), options_(options) {}
+
+bool ObjDetector::RunVideo(const std::string& video_file, int width, int height, int batch_size,
+                           int pipeline_depth, int num_requests, int num_segments,
+                           const std::string& output_name) {
+    if (batch_size < 1) {
+        LOG(ERROR) << "Invalid batch size " << batch_size;
+        return false;
+    }
+    if (num_segments > 1) {
+        if (batch_size != 1 || pipeline_depth > 0 || num_requests > 0) {
+            LOG(ERROR) << "Segments are run with batch size 1, no pipeline and no requests";
+            return false;
+        }
+        return RunVideoSegments(video_file, width, height, num_segments, output_name);
+    }
+    VideoStream stream;
+    if (!OpenStream(video_file, output_name, &stream)) return false;
+    TestVideo& test_video = *stream.test_video;
+    ResolveInputSize(test_video.width(), test_video.height(), &width, &height);
+    if (pipeline_depth > 0) {
+        if (batch_size != 1) {
+            LOG(ERROR) << "Pipelined mode only supports batch size 1, got " << batch_size;
+            return false;
+        }
+        if (!PrepareWorkers(1, 1, width, height)) return false;
+        return RunVideoPipelined(&stream, width, height, pipeline_depth);
+    }
+    if (num_requests > 0) {
+        if (batch_size != 1) {
+            LOG(ERROR) << "Asynchronous mode only supports batch size 1, got " << batch_size;
+            return false;
+        }
+        if (!PrepareWorkers(num_requests, 1, width, height)) return false;
+        return RunVideoAsync(&stream, width, height, num_requests);
+    }
+    if (!PrepareWorkers(1, batch_size, width, height)) return false;
+    InferenceWorker* worker = workers_[0].get();
+
+    // Run.
+    int frames = 0;
+    // Per batch.
+    LatencyRecorder latency;
+    std::vector<BatchFrame> batch(batch_size);
+    // Reused by every frame, so only the first ones grow it.
+    std::vector<Detection> detections;
+    // Runs the first |n| frames of |batch|, so the frames at the end of the video are not lost.
+    auto run_batch = [&](int n) {
+        const auto start = std::chrono::high_resolution_clock::now();
+        if (!worker->Run(n)) return false;
+        const auto elapsed = std::chrono::high_resolution_clock::now() - start;
+        latency.Record(elapsed);
+        VLOG(0) << frames << ": ms=" << ToMs(elapsed);
+
+        // Output.
+        for (int i = 0; i < n; i++) {
+            AVFrame* frame = batch[i].frame.get();
+            worker->GetDetections(i, &detections);
+            Annotate(detections, frame, &stream, &batch[i].mat);
+            if (!stream.Write(frame->pts, detections, batch[i].mat)) return false;
+        }
+        return true;
+    };
+    const InputResizer resizer(test_video.width(), test_video.height(), width, height,
+                               backend_->channels());
+    const auto start = std::chrono::high_resolution_clock::now();
+    while (test_video.NextFrame(&batch[frames % batch_size].frame)) {
+        // Feed in data.
+        const int batch_index = frames % batch_size;
+        FeedIn(resizer, AVFrameToSource(batch[batch_index].frame.get()),
+               worker->input(batch_index));
+        frames++;
+        if (frames % batch_size != 0) continue;
+        if (!run_batch(batch_size)) return false;
+    }
+    if (frames % batch_size != 0 && !run_batch(frames % batch_size)) return false;
+    printf("%s: %d %dx%d frames processed in %d ms(%.1f mspf), inference %s.\n",
+           output_name.c_str(), frames, width, height, (int)latency.sum_ms(),
+           latency.sum_ms() / std::max(1, frames), latency.PercentilesString().c_str());
+    stream.PrintStats();
+    BenchmarkResult result = MakeResult(BaseName(video_file), "batch", batch_size, width, height,
+                                        frames, ElapsedSecs(start), latency);
+    result.counters["detections"] = stream.detection_count;
+    results_.push_back(result);
+    return true;
+}
+
+bool ObjDetector::RunStreams(const std::vector<std::string>& video_files, int width, int height,
+                             int num_workers, int batch_size, double batch_timeout_ms,
+                             const std::vector<std::string>& output_names) {
+    if (num_workers < 1) {
+        LOG(ERROR) << "Need at least 1 worker, got " << num_workers;
+        return false;
+    }
+    if (batch_size < 1) {
+        LOG(ERROR) << "Invalid batch size " << batch_size;
+        return false;
+    }
+    if (backend_->resizable() && (width == 0 || height == 0)) {
+        LOG(ERROR) << "Multiple streams need an explicit input size, got " << width << "x"
+                   << height;
+        return false;
+    }
+    const int num_streams = video_files.size();
+    std::vector<std::unique_ptr<VideoStream>> streams(num_streams);
+    for (int i = 0; i < num_streams; i++) {
+        streams[i].reset(new VideoStream);
+        if (!OpenStream(video_files[i], output_names[i], streams[i].get())) return false;
+    }
+    ResolveInputSize(width, height, &width, &height);
+    if (!PrepareWorkers(num_workers, batch_size, width, height)) return false;
+    std::vector<std::unique_ptr<InputResizer>> resizers;
+    for (const auto& stream : streams) {
+        resizers.emplace_back(new InputResizer(stream->test_video->width(),
+                                               stream->test_video->height(), width, height,
+                                               backend_->channels()));
+    }
+
+    // One per worker, each only used on the thread of its worker.
+    std::vector<LatencyRecorder> worker_latency(num_workers);
+    MultiStreamRunner<PipelineFrame> runner(num_streams, num_workers,
+                                            2 * num_workers * batch_size);
+    // One per stream, so the Mats of its frames keep the size of its video.
+    std::vector<std::unique_ptr<ItemPool<PipelineFrame>>> pools;
+    for (int i = 0; i < num_streams; i++) {
+        pools.emplace_back(new ItemPool<PipelineFrame>(runner.max_items_per_stream(batch_size)));
+    }
+    runner.SetRecycler([&](int stream, std::unique_ptr<PipelineFrame> item) {
+        // The decoder wants its frame back, the rest is kept for the next frame.
+        item->frame.Reset();
+        pools[stream]->Put(std::move(item));
+    });
+    const bool ok = runner.RunBatched(
+        [&](int stream) -> std::unique_ptr<PipelineFrame> {
+            std::unique_ptr<PipelineFrame> item = pools[stream]->Get();
+            if (!streams[stream]->test_video->NextFrame(&item->frame)) return nullptr;
+            item->index = streams[stream]->frames++;
+            // Only allocates the first time a recycled frame is used.
+            item->input.resize(backend_->input_bytes());
+            FeedIn(*resizers[stream], AVFrameToSource(item->frame.get()), item->input.data());
+            return item;
+        },
+        [&](int worker, const std::vector<PipelineFrame*>& items) {
+            return Infer(workers_[worker].get(), items, &worker_latency[worker]);
+        },
+        [&](int stream, PipelineFrame* item) {
+            VideoStream* video_stream = streams[stream].get();
+            Annotate(item->detections, item->frame.get(), video_stream, &item->mat);
+            return video_stream->Write(item->frame->pts, item->detections, item->mat);
+        },
+        batch_size, std::chrono::microseconds(static_cast<int64_t>(batch_timeout_ms * 1000)));
+    if (!ok) return false;
+    for (int i = 0; i < num_streams; i++) {
+        const auto& stats = runner.stream_stats()[i];
+        printf("%s: %d %dx%d frames processed in %d ms(%.1f fps).\n",
+               output_names[i].c_str(), stats.frames, width, height, (int)(stats.secs * 1000),
+               stats.frames / stats.secs);
+        streams[i]->PrintStats();
+    }
+    LatencyRecorder latency;
+    for (const LatencyRecorder& recorder : worker_latency) latency.Merge(recorder);
+    const int frames = runner.total_frames();
+    const int wall_ms = runner.wall_secs() * 1000;
+    printf("%d streams: %d frames processed in %d ms(%.1f mspf), wall %d ms(%.1f fps), "
+           "inference %s.\n%s",
+           num_streams, frames, (int)latency.sum_ms(), latency.sum_ms() / std::max(1, frames),
+           wall_ms, frames * 1000. / wall_ms, latency.PercentilesString().c_str(),
+           runner.WorkerStatsString().c_str());
+    std::string name;
+    int64_t detections = 0;
+    for (const auto& stream : streams) {
+        name += (name.empty() ? "" : ",") + BaseName(stream->video_file);
+        detections += stream->detection_count;
+    }
+    BenchmarkResult result = MakeResult(name, "streams", batch_size, width, height, frames,
+                                        runner.wall_secs(), latency);
+    result.config["workers"] = std::to_string(num_workers);
+    result.config["batch_timeout_ms"] = Sprintf("%g", batch_timeout_ms);
+    result.counters["detections"] = detections;
+    int64_t frame_allocations = 0;
+    for (const auto& pool : pools) frame_allocations += pool->allocations();
+    // PipelineFrames allocated, bounded by the runner's queues however long the videos.
+    result.counters["pipeline_frame_allocs"] = frame_allocations;
+    results_.push_back(result);
+    return true;
+}
+
+bool ObjDetector::RunImage(const std::string& file_name, int width, int height,
+                           const std::string& output) {
+    cv::Mat mat = cv::imread(file_name);
+    if (mat.empty()) {
+        LOG(ERROR) << "Failed to read image " << file_name;
+        return false;
+    }
+    ResolveInputSize(mat.cols, mat.rows, &width, &height);
+    // Where the image goes in the input, which is larger if it is letterboxed into a bucket.
+    int input_width = width;
+    int input_height = height;
+    if (backend_->resizable() && !options_.input_buckets.empty()) {
+        const cv::Size bucket = PickBucket(width, height);
+        const double scale = std::min(static_cast<double>(bucket.width) / width,
+                                      static_cast<double>(bucket.height) / height);
+        width = std::max(1, std::min(bucket.width, static_cast<int>(width * scale + .5)));
+        height = std::max(1, std::min(bucket.height, static_cast<int>(height * scale + .5)));
+        input_width = bucket.width;
+        input_height = bucket.height;
+    }
+    if (!PrepareWorkers(1, 1, input_width, input_height)) return false;
+    InferenceWorker* worker = workers_[0].get();
+    const auto start = std::chrono::high_resolution_clock::now();
+    const InputResizer resizer(mat.cols, mat.rows, width, height, backend_->channels());
+    const SourceImage src = SourceImage::Packed(mat.data, mat.step, true);
+    if (width == input_width && height == input_height) {
+        FeedIn(resizer, src, worker->input(0));
+    } else {
+        FeedInLetterboxed(resizer, width, height, input_width, input_height, src,
+                          worker->input(0));
+    }
+    const auto run_start = std::chrono::high_resolution_clock::now();
+    if (!worker->Run(1)) return false;
+    LatencyRecorder latency;
+    latency.Record(std::chrono::high_resolution_clock::now() - run_start);
+    const double secs = ElapsedSecs(start);
+    printf("%s processed in %d ms.\n", file_name.c_str(), static_cast<int>(secs * 1000));
+    std::vector<Detection> detections;
+    worker->GetDetections(0, &detections);
+    BenchmarkResult result =
+        MakeResult(BaseName(file_name), "image", 1, input_width, input_height, 1, secs, latency);
+    result.counters["detections"] = detections.size();
+    results_.push_back(result);
+    // Back from the input to the image.
+    const float x_scale = static_cast<float>(input_width) / width;
+    const float y_scale = static_cast<float>(input_height) / height;
+    for (Detection& detection : detections) {
+        detection.xmin = std::min(1.f, detection.xmin * x_scale);
+        detection.xmax = std::min(1.f, detection.xmax * x_scale);
+        detection.ymin = std::min(1.f, detection.ymin * y_scale);
+        detection.ymax = std::min(1.f, detection.ymax * y_scale);
+    }
+    DrawDetections(detections, labels_, &mat);
+    cv::imwrite(output, mat);
+    return true;
+}
+
+enum AVPixelFormat ObjDetector::decode_pix_fmt() const {
+    if (backend_->channels() != 3) return AV_PIX_FMT_GRAY8;
+    return options_.decode_yuv ? AV_PIX_FMT_YUV420P : AV_PIX_FMT_RGB24;
+}
+
+enum AVPixelFormat ObjDetector::encode_pix_fmt() const {
+    return backend_->channels() == 3 ? AV_PIX_FMT_BGR24 : AV_PIX_FMT_GRAY8;
+}
+
+bool ObjDetector::OpenStream(const std::string& video_file, const std::string& output_name,
+                             VideoStream* stream) const {
+    return stream->Open(video_file, decode_pix_fmt(), 0, 0, options_.decode, output_name,
+                        options_.output_type, encode_pix_fmt(), options_.encoder);
+}
+
+void ObjDetector::ResolveInputSize(int src_width, int src_height, int* width, int* height) const {
+    if (!backend_->resizable()) {
+        *width = backend_->width();
+        *height = backend_->height();
+    } else if (*width == 0 && *height == 0) {
+        *width = src_width;
+        *height = src_height;
+    } else if (*width == 0) {
+        *width = src_width * *height / src_height;
+    } else if (*height == 0) {
+        *height = src_height * *width / src_width;
+    }
+}
+
+bool ObjDetector::PrepareWorkers(int count, int batch_size, int width, int height) {
+    if (batch_size != worker_batch_size_ || width != worker_width_ || height != worker_height_) {
+        workers_.clear();
+        worker_batch_size_ = worker_width_ = worker_height_ = 0;
+        if (!backend_->Reshape(batch_size, width, height)) return false;
+        worker_batch_size_ = batch_size;
+        worker_width_ = width;
+        worker_height_ = height;
+    }
+    while (workers_.size() < static_cast<size_t>(count)) {
+        std::unique_ptr<InferenceWorker> worker;
+        if (!backend_->CreateWorker(&worker)) return false;
+        workers_.push_back(std::move(worker));
+    }
+    return true;
+}
+
+void ObjDetector::FeedIn(const InputResizer& resizer, const SourceImage& src,
+                         uint8_t* data) const {
+    const InputFormat& format = backend_->input_format();
+    if (format.type == InputFormat::kFloat) {
+        resizer.Resize(src, format.mean, format.scale, reinterpret_cast<float*>(data));
+    } else if (format.planar) {
+        resizer.ResizePlanar(src, data);
+    } else {
+        resizer.Resize(src, data);
+    }
+}
+
+void ObjDetector::FeedInLetterboxed(const InputResizer& resizer, int width, int height,
+                                    int input_width, int input_height, const SourceImage& src,
+                                    uint8_t* data) const {
+    const InputFormat& format = backend_->input_format();
+    const int channels = backend_->channels();
+    const bool is_float = format.type == InputFormat::kFloat;
+    const int value_bytes = is_float ? sizeof(float) : 1;
+    std::vector<uint8_t> image(static_cast<size_t>(width) * height * channels * value_bytes);
+    FeedIn(resizer, src, image.data());
+    const size_t input_values = static_cast<size_t>(input_width) * input_height * channels;
+    if (is_float) {
+        std::fill_n(reinterpret_cast<float*>(data), input_values, -format.mean * format.scale);
+    } else {
+        memset(data, 0, input_values);
+    }
+    if (!is_float && format.planar) {
+        for (int c = 0; c < channels; c++) {
+            CopyRows(image.data() + c * width * height, width, width, height,
+                     data + c * input_width * input_height, input_width);
+        }
+    } else {
+        CopyRows(image.data(), width * channels * value_bytes, width * channels * value_bytes,
+                 height, data, input_width * channels * value_bytes);
+    }
+}
+
+cv::Size ObjDetector::PickBucket(int width, int height) const {
+    const cv::Size* best = nullptr;
+    const cv::Size* largest = nullptr;
+    for (const cv::Size& bucket : options_.input_buckets) {
+        if (largest == nullptr || bucket.area() > largest->area()) largest = &bucket;
+        if (bucket.width >= width && bucket.height >= height &&
+            (best == nullptr || bucket.area() < best->area())) {
+            best = &bucket;
+        }
+    }
+    return best != nullptr ? *best : *largest;
+}
+
+bool ObjDetector::Infer(InferenceWorker* worker, const std::vector<PipelineFrame*>& items,
+                        LatencyRecorder* latency) {
+    const int n = items.size();
+    for (int i = 0; i < n; i++) {
+        memcpy(worker->input(i), items[i]->input.data(), items[i]->input.size());
+    }
+    const auto start = std::chrono::high_resolution_clock::now();
+    if (!worker->Run(n)) return false;
+    const auto elapsed = std::chrono::high_resolution_clock::now() - start;
+    latency->Record(elapsed);
+    VLOG(0) << items[0]->index << ": ms=" << ToMs(elapsed);
+    for (int i = 0; i < n; i++) worker->GetDetections(i, &items[i]->detections);
+    return true;
+}
+
+void ObjDetector::Annotate(const std::vector<Detection>& detections, AVFrame* frame,
+                           const VideoStream* stream, cv::Mat* mat) const {
+    if (!stream->wants_image()) return;
+    AVFrameToMat(frame, mat);
+    DrawDetections(detections, labels_, mat);
+}
+
+bool ObjDetector::RunVideoPipelined(VideoStream* stream, int width, int height,
+                                    int pipeline_depth) {
+    TestVideo* test_video = stream->test_video.get();
+    const InputResizer resizer(test_video->width(), test_video->height(), width, height,
+                               backend_->channels());
+    InferenceWorker* worker = workers_[0].get();
+    int frames = 0;
+    LatencyRecorder latency;
+    Pipeline<PipelineFrame> pipeline(pipeline_depth);
+    // Sized once the stages are known.
+    std::unique_ptr<ItemPool<PipelineFrame>> pool;
+    pipeline.SetSource("decode", [&]() -> std::unique_ptr<PipelineFrame> {
+        std::unique_ptr<PipelineFrame> item = pool->Get();
+        if (!test_video->NextFrame(&item->frame)) return nullptr;
+        item->index = frames++;
+        return item;
+    });
+    // The Mat for the output is made later, after inference, so the model input never waits for
+    // the full frame conversion.
+    pipeline.AddStage("preprocess", [&](PipelineFrame* item) {
+        // Only allocates the first time a recycled frame is used.
+        item->input.resize(backend_->input_bytes());
+        FeedIn(resizer, AVFrameToSource(item->frame.get()), item->input.data());
+        return true;
+    });
+    pipeline.AddStage("infer", [&](PipelineFrame* item) {
+        return Infer(worker, {item}, &latency);
+    });
+    pipeline.AddStage("annotate", [&](PipelineFrame* item) {
+        Annotate(item->detections, item->frame.get(), stream, &item->mat);
+        return true;
+    });
+    pipeline.AddStage("encode", [&](PipelineFrame* item) {
+        return stream->Write(item->frame->pts, item->detections, item->mat);
+    });
+    pool.reset(new ItemPool<PipelineFrame>(pipeline.max_items()));
+    pipeline.SetRecycler([&](std::unique_ptr<PipelineFrame> item) {
+        // The decoder wants its frame back, the rest is kept for the next frame.
+        item->frame.Reset();
+        pool->Put(std::move(item));
+    });
+    if (!pipeline.Run()) return false;
+    const int wall_ms = pipeline.wall_secs() * 1000;
+    printf("%s: %d %dx%d frames processed in %d ms(%.1f mspf), wall %d ms(%.1f fps), "
+           "inference %s.\n%s",
+           stream->output_name.c_str(), frames, width, height, (int)latency.sum_ms(),
+           latency.sum_ms() / std::max(1, frames), wall_ms, frames * 1000. / wall_ms,
+           latency.PercentilesString().c_str(), pipeline.StatsString().c_str());
+    stream->PrintStats();
+    BenchmarkResult result = MakeResult(BaseName(stream->video_file), "pipeline", 1, width,
+                                        height, frames, pipeline.wall_secs(), latency);
+    result.config["pipeline_depth"] = std::to_string(pipeline_depth);
+    result.counters["detections"] = stream->detection_count;
+    // PipelineFrames allocated, at most Pipeline::max_items however long the video.
+    result.counters["pipeline_frame_allocs"] = pool->allocations();
+    results_.push_back(result);
+    return true;
+}
+
+bool ObjDetector::RunVideoAsync(VideoStream* stream, int width, int height, int num_requests) {
+    // A frame on its way through one of the workers. Request i runs on workers_[i].
+    struct Request {
+        int index = 0;
+        FrameHandle frame;
+        std::vector<Detection> detections;
+        cv::Mat mat;
+        std::chrono::steady_clock::time_point start;
+        std::chrono::nanoseconds latency{0};
+        bool ok = false;
+    };
+    TestVideo* test_video = stream->test_video.get();
+    const InputResizer resizer(test_video->width(), test_video->height(), width, height,
+                               backend_->channels());
+    std::vector<Request> requests(num_requests);
+    BoundedQueue<int> idle(num_requests);
+    for (int i = 0; i < num_requests; i++) idle.Push(i);
+    // Requests in the order they completed.
+    BoundedQueue<int> completed(num_requests);
+    std::atomic<bool> failed{false};
+    // From the start of a request to its completion, only used on the sink thread.
+    LatencyRecorder latency;
+
+    std::thread sink([&] {
+        // Requests finish out of order, so hold them back until their turn.
+        std::map<int, int> pending;
+        int next_index = 0;
+        int id;
+        while (completed.Pop(&id)) {
+            if (!requests[id].ok) failed = true;
+            pending[requests[id].index] = id;
+            // Write the frames that are next in order, or drop all of them after a failure.
+            for (auto it = pending.begin();
+                 it != pending.end() && (failed || it->first == next_index);
+                 it = pending.erase(it), next_index++) {
+                Request& request = requests[it->second];
+                if (!failed) {
+                    workers_[it->second]->GetDetections(0, &request.detections);
+                    Annotate(request.detections, request.frame.get(), stream, &request.mat);
+                    if (!stream->Write(request.frame->pts, request.detections, request.mat)) {
+                        failed = true;
+                    }
+                    latency.Record(request.latency);
+                }
+                request.frame.Reset();
+                idle.Push(it->second);
+            }
+        }
+    });
+
+    int frames = 0;
+    const auto start = std::chrono::steady_clock::now();
+    int id;
+    while (!failed && idle.Pop(&id)) {
+        Request& request = requests[id];
+        if (!test_video->NextFrame(&request.frame)) {
+            idle.Push(id);
+            break;
+        }
+        request.index = frames++;
+        InferenceWorker* worker = workers_[id].get();
+        FeedIn(resizer, AVFrameToSource(request.frame.get()), worker->input(0));
+        request.start = std::chrono::steady_clock::now();
+        worker->StartAsync(1, [&, id](bool ok) {
+            Request& request = requests[id];
+            request.latency = std::chrono::steady_clock::now() - request.start;
+            request.ok = ok;
+            completed.Push(id);
+        });
+    }
+    // Every request is idle again once the sink is through with all of them.
+    for (int i = 0; i < num_requests; i++) idle.Pop(&id);
+    completed.Close();
+    sink.join();
+    if (failed) return false;
+
+    const double wall_secs =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    const int wall_ms = wall_secs * 1000;
+    printf("%s: %d %dx%d frames processed with %d requests, wall %d ms(%.1f fps), "
+           "latency %s.\n",
+           stream->output_name.c_str(), frames, width, height, num_requests, wall_ms,
+           frames * 1000. / std::max(1, wall_ms), latency.PercentilesString().c_str());
+    stream->PrintStats();
+    BenchmarkResult result = MakeResult(BaseName(stream->video_file), "async", 1, width, height,
+                                        frames, wall_secs, latency);
+    result.config["requests"] = std::to_string(num_requests);
+    result.counters["detections"] = stream->detection_count;
+    results_.push_back(result);
+    return true;
+}
+
+// Cuts |video_file| at keyframes into |num_segments| parts and runs them concurrently, each on its
+// own thread with its own decoder, worker and output. The outputs of the parts are joined back in
+// order.
+bool ObjDetector::RunVideoSegments(const std::string& video_file, int width, int height,
+                                   int num_segments, const std::string& output_name) {
+    std::vector<VideoSegment> segments;
+    // Frames of the whole video, which the segments have to add up to. Not checked with
+    // sampling, which starts over in every segment and so picks other frames.
+    int video_frames = 0;
+    const bool check_frames = options_.decode.every_nth == 1 &&
+        options_.decode.target_fps == 0 && !options_.decode.keyframes_only;
+    {
+        TestVideo test_video(decode_pix_fmt(), 0, 0, options_.decode);
+        if (!test_video.Init(video_file, nullptr, true)) return false;
+        std::vector<int64_t> keyframe_pts;
+        if (!test_video.ScanKeyframes(&keyframe_pts, &video_frames)) return false;
+        segments = SplitAtKeyframes(keyframe_pts, num_segments);
+        ResolveInputSize(test_video.width(), test_video.height(), &width, &height);
+    }
+    const int n = segments.size();
+    if (!PrepareWorkers(n, 1, width, height)) return false;
+
+    std::vector<std::unique_ptr<VideoStream>> streams(n);
+    std::vector<LatencyRecorder> segment_latency(n);
+    std::vector<char> ok(n, false);
+    std::vector<std::thread> threads;
+    const auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < n; i++) {
+        streams[i].reset(new VideoStream);
+        threads.emplace_back([&, i] {
+            ok[i] = RunSegment(video_file, segments[i], width, height,
+                               Sprintf("%s.seg%d", output_name.c_str(), i), workers_[i].get(),
+                               streams[i].get(), &segment_latency[i]);
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    const double wall_secs = ElapsedSecs(start);
+    const int wall_ms = wall_secs * 1000;
+    if (std::find(ok.begin(), ok.end(), false) != ok.end()) return false;
+
+    int frames = 0;
+    int64_t detections = 0;
+    LatencyRecorder latency;
+    std::vector<std::string> segment_names;
+    std::vector<int> segment_frames;
+    for (int i = 0; i < n; i++) {
+        VideoStream& stream = *streams[i];
+        const LatencyRecorder& segment = segment_latency[i];
+        printf("%s: %d %dx%d frames processed in %d ms(%.1f mspf), inference %s.\n",
+               stream.output_name.c_str(), stream.frames, width, height, (int)segment.sum_ms(),
+               segment.sum_ms() / std::max(1, stream.frames), segment.PercentilesString().c_str());
+        stream.PrintStats();
+        frames += stream.frames;
+        detections += stream.detection_count;
+        latency.Merge(segment);
+        segment_names.push_back(stream.output_name);
+        segment_frames.push_back(stream.frames);
+    }
+    if (check_frames && frames != video_frames) {
+        LOG(ERROR) << "The segments have " << frames << " frames, but the video has "
+                   << video_frames << " packets";
+        return false;
+    }
+    // Closes the sinks, so the segment files are complete.
+    streams.clear();
+    if (!JoinSegmentOutputs(segment_names, segment_frames, output_name)) return false;
+    printf("%s: %d segments, %d %dx%d frames processed in %d ms(%.1f mspf), "
+           "wall %d ms(%.1f fps), inference %s.\n",
+           output_name.c_str(), n, frames, width, height, (int)latency.sum_ms(),
+           latency.sum_ms() / std::max(1, frames), wall_ms, frames * 1000. / wall_ms,
+           latency.PercentilesString().c_str());
+    BenchmarkResult result = MakeResult(BaseName(video_file), "segments", 1, width, height,
+                                        frames, wall_secs, latency);
+    result.config["segments"] = std::to_string(n);
+    result.counters["detections"] = detections;
+    results_.push_back(result);
+    return true;
+}
+
+bool ObjDetector::RunSegment(const std::string& video_file, const VideoSegment& segment,
+                             int width, int height, const std::string& output_name,
+                             InferenceWorker* worker, VideoStream* stream,
+                             LatencyRecorder* latency) {
+    if (!OpenStream(video_file, output_name, stream)) return false;
+    TestVideo* test_video = stream->test_video.get();
+    if (!test_video->Seek(segment.start_pts, segment.end_pts)) return false;
+    const InputResizer resizer(test_video->width(), test_video->height(), width, height,
+                               backend_->channels());
+    FrameHandle frame;
+    std::vector<Detection> detections;
+    cv::Mat mat;
+    while (test_video->NextFrame(&frame)) {
+        FeedIn(resizer, AVFrameToSource(frame.get()), worker->input(0));
+        const auto start = std::chrono::high_resolution_clock::now();
+        if (!worker->Run(1)) return false;
+        latency->Record(std::chrono::high_resolution_clock::now() - start);
+        worker->GetDetections(0, &detections);
+        Annotate(detections, frame.get(), stream, &mat);
+        if (!stream->Write(frame->pts, detections, mat)) return false;
+        stream->frames++;
+    }
+    // Drain the encoder, otherwise the frames it still holds would be missing at the join.
+    return stream->Close();
+}
+
+bool ObjDetector::JoinSegmentOutputs(const std::vector<std::string>& segment_names,
+                                     const std::vector<int>& segment_frames,
+                                     const std::string& output_name) {
+    const OutputType output_type = options_.output_type;
+    std::vector<std::string> paths;
+    for (const std::string& name : segment_names) {
+        paths.push_back(OutputPath(output_type, name));
+    }
+    const std::string path = OutputPath(output_type, output_name);
+    switch (output_type) {
+        case OutputType::kNone:
+            return true;
+        case OutputType::kJpeg: {
+            // Number the images of every segment after those of the segments before it.
+            int index = 0;
+            for (size_t i = 0; i < paths.size(); i++) {
+                for (int j = 0; j < segment_frames[i]; j++, index++) {
+                    const std::string from = Sprintf("%s.%05d.jpeg", paths[i].c_str(), j);
+                    const std::string to = Sprintf("%s.%05d.jpeg", path.c_str(), index);
+                    if (rename(from.c_str(), to.c_str()) != 0) {
+                        LOG(ERROR) << "Failed to rename " << from << " to " << to;
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+        case OutputType::kVideo:
+            if (!ConcatVideos(paths, options_.encoder.container, path)) return false;
+            break;
+        case OutputType::kJsonl:
+        case OutputType::kBinary:
+            if (!ConcatFiles(paths, path)) return false;
+            break;
+    }
+    for (const std::string& segment_path : paths) remove(segment_path.c_str());
+    return true;
+}
+
+BenchmarkResult ObjDetector::MakeResult(const std::string& name, const char* mode,
+                                        int batch_size, int width, int height, int64_t frames,
+                                        double wall_secs, const LatencyRecorder& latency) const {
+    BenchmarkResult result;
+    result.name = name;
+    result.backend = backend_->name();
+    result.batch_size = batch_size;
+    result.width = width;
+    result.height = height;
+    result.config["mode"] = mode;
+    result.config["decode_yuv"] = options_.decode_yuv ? "true" : "false";
+    result.frames = frames;
+    result.wall_secs = wall_secs;
+    result.latency = latency;
+    return result;
+}
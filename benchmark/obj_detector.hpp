@@ -0,0 +1,128 @@
+#ifndef OBJ_DETECTOR_HPP_
+#define OBJ_DETECTOR_HPP_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "inference_backend.hpp"
+#include "latency_recorder.hpp"
+#include "output_sink.hpp"
+#include "preprocess.hpp"
+#include "results.hpp"
+#include "test_video.hpp"
+#include "video_encoder.hpp"
+#include "video_stream.hpp"
+
+struct ObjDetectorOptions {
+    DecodeOptions decode;
+    // The container is also used to join the outputs of segments.
+    EncoderOptions encoder;
+    // Keep decoded frames in YUV 4:2:0 and convert to RGB while resizing to the model input.
+    bool decode_yuv = false;
+    OutputType output_type = OutputType::kVideo;
+    // If not empty, images are letterboxed into the smallest of these input sizes that holds
+    // them, so a resizable backend sees only these shapes however the image sizes vary.
+    std::vector<cv::Size> input_buckets;
+};
+
+// Runs videos and images through an InferenceBackend: decoding, preprocessing straight into the
+// model input, batching, pipelining, annotation and output are all done here, the same way for
+// every engine.
+//
+// A width or height of 0 is taken from the video or image, keeping its aspect ratio. Backends
+// that can't be resized always run at the input size of their model.
+class ObjDetector {
+  public:
+    // |backend| has been initialized and must outlive the detector.
+    ObjDetector(InferenceBackend* backend, const std::vector<std::string>& labels,
+                const ObjDetectorOptions& options);
+
+    // Runs |video_file| in batches of |batch_size| frames. With |pipeline_depth| > 0 every step
+    // runs on its own thread instead, with |num_requests| > 0 that many frames are inferred
+    // asynchronously at once, and with |num_segments| > 1 the video is cut at keyframes into
+    // parts that run concurrently.
+    bool RunVideo(const std::string& video_file, int width, int height, int batch_size,
+                  int pipeline_depth, int num_requests, int num_segments,
+                  const std::string& output_name);
+
+    // Runs all |video_files| concurrently. Frames of every stream are scheduled on |num_workers|
+    // workers of the backend. A worker batches up to |batch_size| frames of any streams, but runs
+    // what it has once the oldest frame has waited |batch_timeout_ms|.
+    bool RunStreams(const std::vector<std::string>& video_files, int width, int height,
+                    int num_workers, int batch_size, double batch_timeout_ms,
+                    const std::vector<std::string>& output_names);
+
+    bool RunImage(const std::string& file_name, int width, int height, const std::string& output);
+
+    // One per successful run so far. The model and the threads are left to the caller.
+    const std::vector<BenchmarkResult>& results() const { return results_; }
+
+  private:
+    struct PipelineFrame;
+
+    enum AVPixelFormat decode_pix_fmt() const;
+    enum AVPixelFormat encode_pix_fmt() const;
+
+    bool OpenStream(const std::string& video_file, const std::string& output_name,
+                    VideoStream* stream) const;
+    // Sets a zero |width| or |height| from the source size, or both to the input size of the
+    // model if the backend can't be resized.
+    void ResolveInputSize(int src_width, int src_height, int* width, int* height) const;
+    // Makes sure there are at least |count| workers with inputs of |batch_size| entries of
+    // width x height. The workers of earlier runs are kept if the shape has not changed.
+    bool PrepareWorkers(int count, int batch_size, int width, int height);
+    // Resizes |src|, an image of the resizer's source size, straight into one batch entry of a
+    // worker input at |data|.
+    void FeedIn(const InputResizer& resizer, const SourceImage& src, uint8_t* data) const;
+    // The same into the top left width x height of an input |input_width| wide and
+    // |input_height| high, padding the rest with black. |resizer| resizes to width x height.
+    void FeedInLetterboxed(const InputResizer& resizer, int width, int height, int input_width,
+                           int input_height, const SourceImage& src, uint8_t* data) const;
+    // The smallest of the input buckets that holds width x height, or the largest one if none.
+    cv::Size PickBucket(int width, int height) const;
+    // Runs the inputs of |items| as one batch on |worker| and reads their detections. Records
+    // the inference time in |latency|.
+    bool Infer(InferenceWorker* worker, const std::vector<PipelineFrame*>& items,
+               LatencyRecorder* latency);
+    // Only if |stream| wants images, converts |frame| into |mat| and draws |detections| onto it.
+    void Annotate(const std::vector<Detection>& detections, AVFrame* frame,
+                  const VideoStream* stream, cv::Mat* mat) const;
+
+    bool RunVideoPipelined(VideoStream* stream, int width, int height, int pipeline_depth);
+    // Keeps up to |num_requests| frames in flight, each on its own worker. The calling thread
+    // decodes and fills idle workers while the others infer, and a sink thread annotates and
+    // writes the finished frames in order.
+    bool RunVideoAsync(VideoStream* stream, int width, int height, int num_requests);
+    bool RunVideoSegments(const std::string& video_file, int width, int height, int num_segments,
+                          const std::string& output_name);
+    // Decodes, runs and outputs the frames of |segment| of |video_file| on |worker| through
+    // |stream|, which is opened at |output_name|. Runs on the calling thread and records the
+    // inference time of every frame in |latency|.
+    bool RunSegment(const std::string& video_file, const VideoSegment& segment, int width,
+                    int height, const std::string& output_name, InferenceWorker* worker,
+                    VideoStream* stream, LatencyRecorder* latency);
+    // Joins the outputs of the segments |segment_names|, which have |segment_frames| frames each,
+    // into the output of the whole video at |output_name|.
+    bool JoinSegmentOutputs(const std::vector<std::string>& segment_names,
+                            const std::vector<int>& segment_frames,
+                            const std::string& output_name);
+    // The result of a run of |name|, the video or image it ran, in |mode|, e.g. "pipeline".
+    BenchmarkResult MakeResult(const std::string& name, const char* mode, int batch_size,
+                               int width, int height, int64_t frames, double wall_secs,
+                               const LatencyRecorder& latency) const;
+
+    InferenceBackend* const backend_;
+    const std::vector<std::string> labels_;
+    const ObjDetectorOptions options_;
+    std::vector<std::unique_ptr<InferenceWorker>> workers_;
+    // The input shape |workers_| were created for.
+    int worker_batch_size_ = 0;
+    int worker_width_ = 0;
+    int worker_height_ = 0;
+    std::vector<BenchmarkResult> results_;
+};
+
+#endif  // OBJ_DETECTOR_HPP_
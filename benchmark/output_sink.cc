@@ -0,0 +1,239 @@
+#include "output_sink.hpp"
+
+#include <glog/logging.h>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+void DrawDetections(const std::vector<Detection>& detections,
+                    const std::vector<std::string>& labels, cv::Mat* mat) {
+    for (const Detection& detection : detections) {
+        const int xmin = detection.xmin * mat->cols;
+        const int ymin = detection.ymin * mat->rows;
+        const int xmax = detection.xmax * mat->cols;
+        const int ymax = detection.ymax * mat->rows;
+        cv::rectangle(*mat, cv::Rect(xmin, ymin, xmax - xmin, ymax - ymin),
+                      cv::Scalar(0, 0, 255), 1);
+        if (detection.class_id >= 0 && detection.class_id < (int)labels.size()) {
+            cv::putText(*mat, labels[detection.class_id], cv::Point(xmin, ymin - 5),
+                        cv::FONT_HERSHEY_COMPLEX, .8, cv::Scalar(10, 255, 30));
+        }
+    }
+}
+
+bool ParseOutputType(const std::string& name, OutputType* type) {
+    if (name == "none") {
+        *type = OutputType::kNone;
+    } else if (name == "video") {
+        *type = OutputType::kVideo;
+    } else if (name == "jpeg") {
+        *type = OutputType::kJpeg;
+    } else if (name == "jsonl") {
+        *type = OutputType::kJsonl;
+    } else if (name == "binary") {
+        *type = OutputType::kBinary;
+    } else {
+        LOG(ERROR) << "Unknown output type '" << name << "'";
+        return false;
+    }
+    return true;
+}
+
+std::string OutputPath(OutputType type, const std::string& output_name) {
+    switch (type) {
+        case OutputType::kJsonl:
+            return output_name + ".jsonl";
+        case OutputType::kBinary:
+            return output_name + ".det";
+        default:
+            return output_name;
+    }
+}
+
+namespace {
+
+class VideoSink : public OutputSink {
+  public:
+    explicit VideoSink(const EncoderOptions& options) : encoder_(options) {}
+
+    bool Init(enum AVPixelFormat pix_fmt, int width, int height, AVRational time_base,
+              const std::string& output_file) {
+        return encoder_.Init(pix_fmt, width, height, time_base, output_file);
+    }
+
+    bool wants_image() const override { return true; }
+
+    bool Write(int64_t pts, const std::vector<Detection>& detections,
+               const cv::Mat& image) override {
+        return encoder_.EncodeImage(image.data, image.step, pts);
+    }
+
+    bool Close() override { return encoder_.Flush(); }
+
+    std::string StatsString() const override { return encoder_.StatsString(); }
+
+  private:
+    VideoEncoder encoder_;
+};
+
+class JpegSink : public OutputSink {
+  public:
+    explicit JpegSink(const std::string& output_name) : output_name_(output_name) {}
+
+    bool wants_image() const override { return true; }
+
+    bool Write(int64_t pts, const std::vector<Detection>& detections,
+               const cv::Mat& image) override {
+        const std::string file_name = Sprintf("%s.%05d.jpeg", output_name_.c_str(), frames_++);
+        if (!cv::imwrite(file_name, image)) {
+            LOG(ERROR) << "Failed to write " << file_name;
+            return false;
+        }
+        return true;
+    }
+
+    bool Close() override { return true; }
+
+    std::string StatsString() const override {
+        return Sprintf("wrote %d jpegs", frames_);
+    }
+
+  private:
+    const std::string output_name_;
+    int frames_ = 0;
+};
+
+class DetectionsSink : public OutputSink {
+  public:
+    explicit DetectionsSink(bool binary) : binary_(binary) {}
+    ~DetectionsSink() { Close(); }
+
+    bool Open(const std::string& output_file) {
+        output_file_ = output_file;
+        file_ = fopen(output_file.c_str(), binary_ ? "wb" : "w");
+        if (file_ == nullptr) {
+            LOG(ERROR) << "Failed to open " << output_file;
+            return false;
+        }
+        return true;
+    }
+
+    bool Write(int64_t pts, const std::vector<Detection>& detections,
+               const cv::Mat& image) override {
+        if (binary_) {
+            WriteBinary(pts, detections);
+        } else {
+            WriteJson(pts, detections);
+        }
+        frames_++;
+        detections_ += detections.size();
+        if (ferror(file_)) {
+            LOG(ERROR) << "Failed to write " << output_file_;
+            return false;
+        }
+        return true;
+    }
+
+    bool Close() override {
+        if (file_ == nullptr) return true;
+        const bool ok = fclose(file_) == 0;
+        file_ = nullptr;
+        if (!ok) LOG(ERROR) << "Failed to close " << output_file_;
+        return ok;
+    }
+
+    std::string StatsString() const override {
+        return Sprintf("wrote %d frames with %lld detections to %s", frames_,
+                       (long long)detections_, output_file_.c_str());
+    }
+
+  private:
+    void WriteJson(int64_t pts, const std::vector<Detection>& detections) {
+        fprintf(file_, "{\"pts\":%lld,\"detections\":[", (long long)pts);
+        for (size_t i = 0; i < detections.size(); i++) {
+            const Detection& d = detections[i];
+            fprintf(file_, "%s{\"class\":%d,\"score\":%.4g,\"box\":[%.4g,%.4g,%.4g,%.4g]}",
+                    i > 0 ? "," : "", d.class_id, d.score, d.xmin, d.ymin, d.xmax, d.ymax);
+        }
+        fputs("]}\n", file_);
+    }
+
+    void WriteBinary(int64_t pts, const std::vector<Detection>& detections) {
+        const int32_t count = detections.size();
+        fwrite(&pts, sizeof(pts), 1, file_);
+        fwrite(&count, sizeof(count), 1, file_);
+        for (const Detection& d : detections) {
+            const int32_t class_id = d.class_id;
+            const float values[5] = {d.score, d.xmin, d.ymin, d.xmax, d.ymax};
+            fwrite(&class_id, sizeof(class_id), 1, file_);
+            fwrite(values, sizeof(values), 1, file_);
+        }
+    }
+
+    const bool binary_;
+    std::string output_file_;
+    FILE* file_ = nullptr;
+    int frames_ = 0;
+    int64_t detections_ = 0;
+};
+
+}  // namespace
+
+bool OpenOutputSink(OutputType type, const std::string& output_name, enum AVPixelFormat pix_fmt,
+                    int width, int height, AVRational time_base,
+                    const EncoderOptions& encoder_options, std::unique_ptr<OutputSink>* sink) {
+    const std::string path = OutputPath(type, output_name);
+    switch (type) {
+        case OutputType::kNone:
+            sink->reset();
+            return true;
+        case OutputType::kVideo: {
+            std::unique_ptr<VideoSink> video_sink(new VideoSink(encoder_options));
+            if (!video_sink->Init(pix_fmt, width, height, time_base, path)) return false;
+            sink->reset(video_sink.release());
+            return true;
+        }
+        case OutputType::kJpeg:
+            sink->reset(new JpegSink(path));
+            return true;
+        case OutputType::kJsonl:
+        case OutputType::kBinary: {
+            std::unique_ptr<DetectionsSink> detections_sink(
+                new DetectionsSink(type == OutputType::kBinary));
+            if (!detections_sink->Open(path)) return false;
+            sink->reset(detections_sink.release());
+            return true;
+        }
+    }
+    LOG(FATAL) << "Should not reach here!";
+    return false;
+}
+
+bool ConcatFiles(const std::vector<std::string>& inputs, const std::string& output_file) {
+    FILE* out = fopen(output_file.c_str(), "wb");
+    if (out == nullptr) {
+        LOG(ERROR) << "Failed to open " << output_file;
+        return false;
+    }
+    bool ok = true;
+    char buf[1 << 16];
+    for (const std::string& input : inputs) {
+        FILE* in = fopen(input.c_str(), "rb");
+        if (in == nullptr) {
+            LOG(ERROR) << "Failed to open " << input;
+            ok = false;
+            break;
+        }
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+            if (fwrite(buf, 1, n, out) != n) {
+                LOG(ERROR) << "Failed to write " << output_file;
+                ok = false;
+                break;
+            }
+        }
+        fclose(in);
+        if (!ok) break;
+    }
+    if (fclose(out) != 0) ok = false;
+    return ok;
+}
@@ -0,0 +1,70 @@
+#ifndef OUTPUT_SINK_HPP_
+#define OUTPUT_SINK_HPP_
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "postprocess.hpp"
+#include "utils.hpp"
+#include "video_encoder.hpp"
+
+// Draws |detections| with their labels onto |mat|.
+void DrawDetections(const std::vector<Detection>& detections,
+                    const std::vector<std::string>& labels, cv::Mat* mat);
+
+// What is written for every processed frame of a video.
+enum class OutputType {
+    // Nothing, for benchmarking inference alone.
+    kNone,
+    // The annotated frames, as an H.264 video.
+    kVideo,
+    // The annotated frames, as one jpeg each.
+    kJpeg,
+    // The detections as JSON lines, one per frame:
+    //   {"pts":123,"detections":[{"class":0,"score":0.87,"box":[xmin,ymin,xmax,ymax]}]}
+    kJsonl,
+    // The detections packed in host byte order. Per frame an int64 pts and an int32 count,
+    // followed by count times an int32 class, a float score and the float box xmin, ymin, xmax,
+    // ymax.
+    kBinary,
+};
+
+// Parses "none", "video", "jpeg", "jsonl" or "binary".
+bool ParseOutputType(const std::string& name, OutputType* type);
+
+// The file an output of |type| for |output_name| goes to. Jpegs are written next to it, with the
+// frame number and ".jpeg" appended.
+std::string OutputPath(OutputType type, const std::string& output_name);
+
+// Receives the results of the frames of one video, in order.
+class OutputSink {
+  public:
+    virtual ~OutputSink() {}
+
+    // Whether Write needs the annotated frame. If not, callers skip converting the frame and
+    // drawing on it, which is most of the work after inference.
+    virtual bool wants_image() const { return false; }
+    // Writes the results of the next frame. |image| is the annotated frame if wants_image(), and
+    // may be empty otherwise.
+    virtual bool Write(int64_t pts, const std::vector<Detection>& detections,
+                       const cv::Mat& image) = 0;
+    // Finishes the output after the last frame. Further calls do nothing.
+    virtual bool Close() = 0;
+    virtual std::string StatsString() const = 0;
+};
+
+// Opens a sink of |type| at OutputPath(type, output_name), or sets |sink| to null for kNone.
+// The video sink encodes |pix_fmt| images of width x height with |encoder_options|.
+bool OpenOutputSink(OutputType type, const std::string& output_name, enum AVPixelFormat pix_fmt,
+                    int width, int height, AVRational time_base,
+                    const EncoderOptions& encoder_options, std::unique_ptr<OutputSink>* sink);
+
+// Appends the files |inputs| to each other into |output_file|.
+bool ConcatFiles(const std::vector<std::string>& inputs, const std::string& output_file);
+
+#endif  // OUTPUT_SINK_HPP_
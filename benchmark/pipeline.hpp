@@ -0,0 +1,171 @@
+#ifndef PIPELINE_HPP_
+#define PIPELINE_HPP_
+
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bounded_queue.hpp"
+#include "latency_recorder.hpp"
+
+// Runs a chain of stages, each on its own thread, connected by bounded queues. Items flow from
+// the source through every stage in order, so stage i works on item n while stage i+1 works on
+// item n-1. Throughput is bounded by the slowest stage instead of the sum of all stages.
+template<typename Item>
+class Pipeline {
+  public:
+    typedef std::unique_ptr<Item> ItemPtr;
+    // Produces the next item, or nullptr at the end of input.
+    typedef std::function<ItemPtr()> SourceFunc;
+    // Processes an item in place. Returning false aborts the whole pipeline.
+    typedef std::function<bool(Item*)> StageFunc;
+    // Takes back an item that is done, e.g. to hand it out of the source again.
+    typedef std::function<void(ItemPtr)> RecycleFunc;
+
+    struct StageStats {
+        std::string name;
+        int items = 0;
+        double busy_secs = 0;
+        LatencyRecorder latency;
+    };
+
+    // Every queue between two stages holds at most |depth| items.
+    explicit Pipeline(size_t depth) : depth_(depth) {}
+
+    void SetSource(const std::string& name, SourceFunc func) {
+        source_name_ = name;
+        source_ = func;
+    }
+
+    void AddStage(const std::string& name, StageFunc func) {
+        stage_names_.push_back(name);
+        stages_.push_back(func);
+    }
+
+    // Items that left the last stage, or were dropped because the pipeline failed, go to |func|
+    // instead of being destroyed.
+    void SetRecycler(RecycleFunc func) { recycle_ = func; }
+
+    // Most items in flight at once: one in the source, one in every stage and |depth| in front of
+    // every stage. A pool of items this large never runs dry.
+    size_t max_items() const { return 1 + stages_.size() * (depth_ + 1); }
+
+    // Blocks until the source is exhausted and every item has left the last stage.
+    bool Run() {
+        const size_t num_stages = stages_.size();
+        stats_.assign(num_stages + 1, StageStats());
+        stats_[0].name = source_name_;
+        for (size_t i = 0; i < num_stages; i++) stats_[i + 1].name = stage_names_[i];
+        // queues_[i] feeds stages_[i].
+        queues_.clear();
+        for (size_t i = 0; i < num_stages; i++) {
+            queues_.emplace_back(new BoundedQueue<ItemPtr>(depth_));
+        }
+        failed_ = false;
+
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        threads.emplace_back([this] { RunSource(); });
+        for (size_t i = 0; i < num_stages; i++) {
+            threads.emplace_back([this, i] { RunStage(i); });
+        }
+        for (auto& thread : threads) thread.join();
+        wall_secs_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        queues_.clear();
+        return !failed_;
+    }
+
+    const std::vector<StageStats>& stats() const { return stats_; }
+    double wall_secs() const { return wall_secs_; }
+
+    // One line per stage with its per-item cost, the fraction of wall time it was busy and the
+    // percentiles of its per-item time. The stage closest to 100% is the bottleneck.
+    std::string StatsString() const {
+        std::string result;
+        char line[300];
+        for (const auto& stage : stats_) {
+            snprintf(line, sizeof(line), "  %-12s %6d items %8.2f ms/item %5.1f%% busy, %s\n",
+                     stage.name.c_str(), stage.items,
+                     stage.items > 0 ? stage.busy_secs * 1000 / stage.items : 0.,
+                     wall_secs_ > 0 ? stage.busy_secs * 100 / wall_secs_ : 0.,
+                     stage.latency.PercentilesString().c_str());
+            result += line;
+        }
+        return result;
+    }
+
+  private:
+    void Abort() {
+        failed_ = true;
+        for (auto& queue : queues_) queue->Close();
+    }
+
+    void RunSource() {
+        StageStats& stats = stats_[0];
+        while (!failed_) {
+            const auto start = std::chrono::steady_clock::now();
+            ItemPtr item = source_();
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+            stats.busy_secs += std::chrono::duration<double>(elapsed).count();
+            if (!item) break;
+            stats.items++;
+            stats.latency.Record(elapsed);
+            if (queues_.empty()) continue;
+            if (!queues_[0]->Push(std::move(item))) break;
+        }
+        if (!queues_.empty()) queues_[0]->Close();
+    }
+
+    void RunStage(size_t index) {
+        StageStats& stats = stats_[index + 1];
+        BoundedQueue<ItemPtr>* next = index + 1 < queues_.size() ? queues_[index + 1].get() : nullptr;
+        ItemPtr item;
+        while (queues_[index]->Pop(&item)) {
+            if (failed_) {
+                Recycle(std::move(item));
+                continue;
+            }
+            const auto start = std::chrono::steady_clock::now();
+            const bool ok = stages_[index](item.get());
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+            stats.busy_secs += std::chrono::duration<double>(elapsed).count();
+            stats.items++;
+            stats.latency.Record(elapsed);
+            if (!ok) {
+                Abort();
+                Recycle(std::move(item));
+                continue;
+            }
+            if (next != nullptr) {
+                next->Push(std::move(item));
+            } else {
+                Recycle(std::move(item));
+            }
+            item.reset();
+        }
+        if (next != nullptr) next->Close();
+    }
+
+    void Recycle(ItemPtr item) {
+        if (recycle_) recycle_(std::move(item));
+    }
+
+    const size_t depth_;
+    std::string source_name_;
+    SourceFunc source_;
+    std::vector<std::string> stage_names_;
+    std::vector<StageFunc> stages_;
+    RecycleFunc recycle_;
+    std::vector<std::unique_ptr<BoundedQueue<ItemPtr>>> queues_;
+    std::vector<StageStats> stats_;
+    std::atomic<bool> failed_{false};
+    double wall_secs_ = 0;
+};
+
+#endif  // PIPELINE_HPP_
@@ -0,0 +1,320 @@
+#include "postprocess.hpp"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <limits>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define POSTPROCESS_X86 1
+#endif
+
+namespace {
+
+struct Kernels {
+    const char* isa;
+    int (*scores_above)(const float* values, int count, int stride, float threshold,
+                        int* indices);
+};
+
+// Appends the indices in [begin, count) to |indices| and returns how many there are.
+int ScoresAboveFrom(const float* values, int begin, int count, int stride, float threshold,
+                    int* indices) {
+    int n = 0;
+    for (int i = begin; i < count; i++) {
+        if (values[static_cast<size_t>(i) * stride] >= threshold) indices[n++] = i;
+    }
+    return n;
+}
+
+int ScoresAboveScalar(const float* values, int count, int stride, float threshold,
+                      int* indices) {
+    return ScoresAboveFrom(values, 0, count, stride, threshold, indices);
+}
+
+// Appends |base| plus the positions of the set bits of |mask| to |indices|.
+inline int AppendMask(int mask, int base, int* indices) {
+    int n = 0;
+    while (mask != 0) {
+        indices[n++] = base + __builtin_ctz(mask);
+        mask &= mask - 1;
+    }
+    return n;
+}
+
+#ifdef POSTPROCESS_X86
+
+// SSE has no gather, so strided scores take the scalar loop.
+__attribute__((target("sse4.1")))
+int ScoresAboveSse41(const float* values, int count, int stride, float threshold,
+                     int* indices) {
+    if (stride != 1) return ScoresAboveScalar(values, count, stride, threshold, indices);
+    const __m128 vthreshold = _mm_set1_ps(threshold);
+    int n = 0;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m128 v = _mm_loadu_ps(values + i);
+        n += AppendMask(_mm_movemask_ps(_mm_cmpge_ps(v, vthreshold)), i, indices + n);
+    }
+    return n + ScoresAboveFrom(values, i, count, stride, threshold, indices + n);
+}
+
+__attribute__((target("avx2")))
+int ScoresAboveAvx2(const float* values, int count, int stride, float threshold,
+                    int* indices) {
+    const __m256 vthreshold = _mm256_set1_ps(threshold);
+    int n = 0;
+    int i = 0;
+    if (stride == 1) {
+        for (; i + 8 <= count; i += 8) {
+            const __m256 v = _mm256_loadu_ps(values + i);
+            const int mask = _mm256_movemask_ps(_mm256_cmp_ps(v, vthreshold, _CMP_GE_OQ));
+            n += AppendMask(mask, i, indices + n);
+        }
+    } else {
+        const __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                                   _mm256_set1_epi32(stride));
+        for (; i + 8 <= count; i += 8) {
+            const __m256 v =
+                _mm256_i32gather_ps(values + static_cast<size_t>(i) * stride, offsets, 4);
+            const int mask = _mm256_movemask_ps(_mm256_cmp_ps(v, vthreshold, _CMP_GE_OQ));
+            n += AppendMask(mask, i, indices + n);
+        }
+    }
+    return n + ScoresAboveFrom(values, i, count, stride, threshold, indices + n);
+}
+
+#endif  // POSTPROCESS_X86
+
+Kernels SelectKernels() {
+    const Kernels scalar = {"scalar", ScoresAboveScalar};
+    std::string limit;
+    if (const char* env = getenv("POSTPROCESS_ISA")) limit = env;
+#ifdef POSTPROCESS_X86
+    __builtin_cpu_init();
+    const Kernels avx2 = {"avx2", ScoresAboveAvx2};
+    const Kernels sse41 = {"sse4.1", ScoresAboveSse41};
+    if (limit != "scalar" && limit != "sse4.1" && __builtin_cpu_supports("avx2")) return avx2;
+    if (limit != "scalar" && __builtin_cpu_supports("sse4.1")) return sse41;
+#endif
+    return scalar;
+}
+
+const Kernels& kernels() {
+    static const Kernels k = SelectKernels();
+    return k;
+}
+
+bool HigherScore(const Detection& a, const Detection& b) {
+    return a.score > b.score;
+}
+
+float Logit(float p) {
+    if (p <= 0) return -std::numeric_limits<float>::infinity();
+    if (p >= 1) return std::numeric_limits<float>::infinity();
+    return logf(p / (1 - p));
+}
+
+// The box_coder scales of the SSD configs: y, x, height, width.
+const float kBoxScales[4] = {10.f, 10.f, 5.f, 5.f};
+
+float AnchorScale(float min_scale, float max_scale, int index, int count) {
+    if (count == 1) return (min_scale + max_scale) / 2;
+    return min_scale + (max_scale - min_scale) * index / (count - 1);
+}
+
+// Index buffer for ScoresAbove of at least |count| entries. Each worker thread keeps its own, so
+// only its first frames allocate.
+std::vector<int>& ScratchIndices(int count) {
+    thread_local std::vector<int> indices;
+    if (indices.size() < static_cast<size_t>(count)) indices.resize(count);
+    return indices;
+}
+
+}  // namespace
+
+const char* PostprocessIsa() {
+    return kernels().isa;
+}
+
+int ScoresAbove(const float* values, int count, int stride, float threshold, int* indices) {
+    return kernels().scores_above(values, count, stride, threshold, indices);
+}
+
+void KeepTopK(int k, std::vector<Detection>* detections) {
+    if (k > 0 && static_cast<size_t>(k) < detections->size()) {
+        std::partial_sort(detections->begin(), detections->begin() + k, detections->end(),
+                          HigherScore);
+        detections->resize(k);
+    } else {
+        std::sort(detections->begin(), detections->end(), HigherScore);
+    }
+}
+
+float IoU(const Detection& a, const Detection& b) {
+    const float width = std::min(a.xmax, b.xmax) - std::max(a.xmin, b.xmin);
+    const float height = std::min(a.ymax, b.ymax) - std::max(a.ymin, b.ymin);
+    if (width <= 0 || height <= 0) return 0;
+    const float intersection = width * height;
+    const float area_a = (a.xmax - a.xmin) * (a.ymax - a.ymin);
+    const float area_b = (b.xmax - b.xmin) * (b.ymax - b.ymin);
+    return intersection / (area_a + area_b - intersection);
+}
+
+void NonMaxSuppression(float iou_threshold, int max_detections,
+                       std::vector<Detection>* detections) {
+    std::stable_sort(detections->begin(), detections->end(), HigherScore);
+    size_t kept = 0;
+    for (size_t i = 0; i < detections->size(); i++) {
+        if (max_detections > 0 && kept == static_cast<size_t>(max_detections)) break;
+        const Detection& candidate = (*detections)[i];
+        bool suppressed = false;
+        if (iou_threshold < 1) {
+            for (size_t j = 0; j < kept && !suppressed; j++) {
+                const Detection& other = (*detections)[j];
+                suppressed = other.class_id == candidate.class_id &&
+                             IoU(other, candidate) > iou_threshold;
+            }
+        }
+        if (!suppressed) (*detections)[kept++] = candidate;
+    }
+    detections->resize(kept);
+}
+
+void FilterDetections(const float* boxes, const float* classes, const float* scores, int count,
+                      int class_offset, const PostprocessOptions& options,
+                      std::vector<Detection>* detections) {
+    detections->clear();
+    std::vector<int>& indices = ScratchIndices(count);
+    const int n = ScoresAbove(scores, count, 1, options.score_threshold, indices.data());
+    for (int k = 0; k < n; k++) {
+        const int i = indices[k];
+        const int class_id = static_cast<int>(classes[i]) + class_offset;
+        if (class_id < 0) continue;
+        const float* box = boxes + 4 * i;
+        detections->push_back({class_id, scores[i], box[1], box[0], box[3], box[2]});
+    }
+    KeepTopK(options.top_k, detections);
+}
+
+void FilterDetectionOutput(const float* rows, int max_rows, const PostprocessOptions& options,
+                           std::vector<Detection>* detections) {
+    detections->clear();
+    int count = 0;
+    while (count < max_rows && rows[7 * count] >= 0) count++;
+    std::vector<int>& indices = ScratchIndices(count);
+    const int n = ScoresAbove(rows + 2, count, 7, options.score_threshold, indices.data());
+    for (int k = 0; k < n; k++) {
+        const float* row = rows + 7 * indices[k];
+        const int label = static_cast<int>(row[1]);
+        if (label <= 0) continue;
+        detections->push_back({label - 1, row[2], row[3], row[4], row[5], row[6]});
+    }
+    KeepTopK(options.top_k, detections);
+}
+
+std::vector<Anchor> GenerateSsdAnchors(const SsdAnchorOptions& options) {
+    std::vector<Anchor> anchors;
+    const int num_layers = options.strides.size();
+    int layer = 0;
+    while (layer < num_layers) {
+        // Layers of the same stride share one feature map.
+        std::vector<float> aspect_ratios;
+        std::vector<float> scales;
+        int last_layer = layer;
+        for (; last_layer < num_layers && options.strides[last_layer] == options.strides[layer];
+             last_layer++) {
+            const float scale =
+                AnchorScale(options.min_scale, options.max_scale, last_layer, num_layers);
+            if (last_layer == 0 && options.reduce_boxes_in_lowest_layer) {
+                aspect_ratios.insert(aspect_ratios.end(), {1.f, 2.f, .5f});
+                scales.insert(scales.end(), {.1f, scale, scale});
+                continue;
+            }
+            for (float aspect_ratio : options.aspect_ratios) {
+                aspect_ratios.push_back(aspect_ratio);
+                scales.push_back(scale);
+            }
+            if (options.interpolated_scale_aspect_ratio > 0) {
+                const float next_scale =
+                    last_layer == num_layers - 1
+                        ? 1.f
+                        : AnchorScale(options.min_scale, options.max_scale, last_layer + 1,
+                                      num_layers);
+                aspect_ratios.push_back(options.interpolated_scale_aspect_ratio);
+                scales.push_back(sqrtf(scale * next_scale));
+            }
+        }
+        const int stride = options.strides[layer];
+        const int rows = (options.input_height + stride - 1) / stride;
+        const int cols = (options.input_width + stride - 1) / stride;
+        for (int y = 0; y < rows; y++) {
+            for (int x = 0; x < cols; x++) {
+                for (size_t i = 0; i < scales.size(); i++) {
+                    const float ratio_sqrt = sqrtf(aspect_ratios[i]);
+                    anchors.push_back({(y + .5f) / rows, (x + .5f) / cols,
+                                       scales[i] / ratio_sqrt, scales[i] * ratio_sqrt});
+                }
+            }
+        }
+        layer = last_layer;
+    }
+    return anchors;
+}
+
+SsdDecoder::SsdDecoder(const std::vector<Anchor>& anchors, int num_classes,
+                       const PostprocessOptions& options)
+    : anchors_(anchors), num_classes_(num_classes), options_(options),
+      logit_threshold_(Logit(options.score_threshold)) {}
+
+void SsdDecoder::Decode(const float* box_encodings, const float* class_logits,
+                        std::vector<Detection>* detections) const {
+    struct Candidate {
+        float logit;
+        int anchor;
+        int class_id;
+    };
+    // The logits are scanned as one array, a chunk of whole anchors at a time.
+    const int chunk_anchors = std::max(1, 4096 / num_classes_);
+    std::vector<int>& indices = ScratchIndices(chunk_anchors * num_classes_);
+    thread_local std::vector<Candidate> candidates;
+    candidates.clear();
+    for (int first = 0; first < num_anchors(); first += chunk_anchors) {
+        const int anchors = std::min(chunk_anchors, num_anchors() - first);
+        const float* logits = class_logits + static_cast<size_t>(first) * num_classes_;
+        const int n = ScoresAbove(logits, anchors * num_classes_, 1, logit_threshold_,
+                                  indices.data());
+        for (int k = 0; k < n; k++) {
+            const int cls = indices[k] % num_classes_;
+            // Class 0 is the background.
+            if (cls == 0) continue;
+            candidates.push_back({logits[indices[k]], first + indices[k] / num_classes_, cls - 1});
+        }
+    }
+    // The sigmoid keeps the order, so top-K can go by the logits.
+    const auto higher_logit = [](const Candidate& a, const Candidate& b) {
+        return a.logit > b.logit;
+    };
+    if (options_.top_k > 0 && candidates.size() > static_cast<size_t>(options_.top_k)) {
+        std::partial_sort(candidates.begin(), candidates.begin() + options_.top_k,
+                          candidates.end(), higher_logit);
+        candidates.resize(options_.top_k);
+    }
+
+    detections->clear();
+    for (const Candidate& candidate : candidates) {
+        const Anchor& anchor = anchors_[candidate.anchor];
+        const float* encoding = box_encodings + 4 * candidate.anchor;
+        const float y_center = encoding[0] / kBoxScales[0] * anchor.height + anchor.y_center;
+        const float x_center = encoding[1] / kBoxScales[1] * anchor.width + anchor.x_center;
+        const float half_height = expf(encoding[2] / kBoxScales[2]) * anchor.height / 2;
+        const float half_width = expf(encoding[3] / kBoxScales[3]) * anchor.width / 2;
+        detections->push_back({candidate.class_id, 1 / (1 + expf(-candidate.logit)),
+                               x_center - half_width, y_center - half_height,
+                               x_center + half_width, y_center + half_height});
+    }
+    NonMaxSuppression(options_.iou_threshold, options_.max_detections, detections);
+}
@@ -0,0 +1,117 @@
+#ifndef POSTPROCESS_HPP_
+#define POSTPROCESS_HPP_
+
+#include <vector>
+
+// Detection post-processing shared by the detectors: score thresholding, top-K, non-maximum
+// suppression and SSD box decoding. Detections only carry a class index, so nothing here builds
+// strings; labels are looked up when drawing.
+//
+// The score scans are vectorized the same way as the preprocess kernels. On first use the
+// widest implementation the CPU supports is picked: AVX2, SSE4.1 or plain C++. Setting the
+// POSTPROCESS_ISA environment variable to "scalar", "sse4.1" or "avx2" caps the choice.
+
+// A detected object. The box corners are relative to the frame size, in [0, 1].
+struct Detection {
+    // Index of the class in the labels file.
+    int class_id;
+    float score;
+    float xmin, ymin, xmax, ymax;
+};
+
+// Name of the implementation in use, e.g. "avx2".
+const char* PostprocessIsa();
+
+// Stores the indices i < |count| with values[i * stride] >= |threshold| in |indices|, in
+// increasing order, and returns how many there are. |indices| needs room for |count| of them.
+int ScoresAbove(const float* values, int count, int stride, float threshold, int* indices);
+
+// Keeps the |k| detections with the highest scores, sorted by descending score. Keeps all of
+// them, sorted, if |k| <= 0.
+void KeepTopK(int k, std::vector<Detection>* detections);
+
+// Intersection over union of the boxes of |a| and |b|.
+float IoU(const Detection& a, const Detection& b);
+
+// Greedy class-aware non-maximum suppression. Sorts |detections| by descending score and drops
+// every detection that overlaps a higher scored one of the same class by an IoU above
+// |iou_threshold|. At most |max_detections| are kept if that is > 0.
+void NonMaxSuppression(float iou_threshold, int max_detections,
+                       std::vector<Detection>* detections);
+
+struct PostprocessOptions {
+    // Detections scored below this are dropped before anything else.
+    float score_threshold = .5f;
+    // Detections kept after thresholding, the highest scored first. 0 for all.
+    int top_k = 100;
+    // Used where the model leaves NMS to us. Values >= 1 disable it.
+    float iou_threshold = .6f;
+    // Detections kept after NMS, 0 for all.
+    int max_detections = 100;
+};
+
+// Parses the output of a model with in-graph post-processing, such as the TF object detection
+// API graphs or TFLite_Detection_PostProcess: |count| boxes as [ymin, xmin, ymax, xmax] with
+// their class and score. The class id is class + |class_offset|, and negative ids, such as the
+// background with an offset of -1, are dropped. Applies the threshold and top-K of |options|.
+void FilterDetections(const float* boxes, const float* classes, const float* scores, int count,
+                      int class_offset, const PostprocessOptions& options,
+                      std::vector<Detection>* detections);
+
+// Parses the output of an OpenVINO DetectionOutput layer: up to |max_rows| rows of
+// [image_id, label, score, xmin, ymin, xmax, ymax], ended early by an image_id < 0. Label 0 is
+// the background, so the class id is label - 1. Applies the threshold and top-K of |options|.
+void FilterDetectionOutput(const float* rows, int max_rows, const PostprocessOptions& options,
+                           std::vector<Detection>* detections);
+
+// An SSD anchor box, relative to the input size.
+struct Anchor {
+    float y_center, x_center, height, width;
+};
+
+// The anchors of the TF object detection API ssd_anchor_generator. The defaults are those of
+// the MobileNet SSD models, which give 1917 anchors for a 300x300 input.
+struct SsdAnchorOptions {
+    int input_width = 300;
+    int input_height = 300;
+    float min_scale = .2f;
+    float max_scale = .95f;
+    // One feature map per stride, from the finest.
+    std::vector<int> strides = {16, 32, 64, 128, 256, 512};
+    std::vector<float> aspect_ratios = {1.f, 2.f, .5f, 3.f, 1.f / 3};
+    // Adds an anchor of the scale between this layer's and the next one's, with this aspect
+    // ratio. 0 for none.
+    float interpolated_scale_aspect_ratio = 1.f;
+    // The finest layer only gets 3 anchors, the first one at scale .1.
+    bool reduce_boxes_in_lowest_layer = true;
+};
+
+std::vector<Anchor> GenerateSsdAnchors(const SsdAnchorOptions& options);
+
+// Turns the raw outputs of an SSD graph exported without post-processing into detections. The
+// score threshold is applied to the raw logits first, so only the few anchors and classes above
+// it get their score and box decoded. Decode is const and may run concurrently.
+class SsdDecoder {
+  public:
+    // |num_classes| counts the background, which is class 0 of the class predictions. Class c
+    // becomes class id c - 1, as with TFLite_Detection_PostProcess.
+    SsdDecoder(const std::vector<Anchor>& anchors, int num_classes,
+               const PostprocessOptions& options);
+
+    int num_anchors() const { return anchors_.size(); }
+    int num_classes() const { return num_classes_; }
+
+    // |box_encodings| holds [ty, tx, th, tw] per anchor and |class_logits| |num_classes| logits
+    // per anchor, which are turned into scores with a sigmoid.
+    void Decode(const float* box_encodings, const float* class_logits,
+                std::vector<Detection>* detections) const;
+
+  private:
+    const std::vector<Anchor> anchors_;
+    const int num_classes_;
+    const PostprocessOptions options_;
+    // options_.score_threshold as a logit.
+    const float logit_threshold_;
+};
+
+#endif  // POSTPROCESS_HPP_
@@ -0,0 +1,807 @@
+#include "preprocess.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PREPROCESS_X86 1
+#endif
+
+namespace {
+
+// BT.601 YUV to RGB in Q14 fixed point:
+//   R = (Y - y_offset) * y_mul + rv * (V - 128)
+//   G = (Y - y_offset) * y_mul - gu * (U - 128) - gv * (V - 128)
+//   B = (Y - y_offset) * y_mul + bu * (U - 128)
+struct YuvToRgb {
+    int y_offset, y_mul, rv, gu, gv, bu;
+};
+
+const YuvToRgb kLimitedRange = {16, 19077, 26149, 6419, 13320, 33050};
+const YuvToRgb kFullRange = {0, 16384, 22970, 5638, 11700, 29032};
+
+inline uint8_t ClampQ14(int v) {
+    v = (v + (1 << 13)) >> 14;
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// Bilinear resize weights are fixed point: Q7 along a row, which keeps a filtered row in int16,
+// and Q14 between rows.
+const int kWeightBitsX = 7;
+const int kWeightBitsY = 14;
+const int kBlendShift = kWeightBitsX + kWeightBitsY;
+
+// Row kernels. The image level functions below only deal with strides.
+struct Kernels {
+    const char* isa;
+    void (*normalize)(const uint8_t* src, int n, float mean, float scale, float* dst);
+    void (*packed_to_planar)(const uint8_t* src, int width, uint8_t* c0, uint8_t* c1, uint8_t* c2);
+    void (*planar_to_packed)(const uint8_t* c0, const uint8_t* c1, const uint8_t* c2, int width,
+                             uint8_t* dst);
+    void (*swap_rb)(const uint8_t* src, int width, uint8_t* dst);
+    // Converts a row of Y and its half width U and V rows to R, G and B rows.
+    void (*yuv_to_rgb)(const uint8_t* y, const uint8_t* u, const uint8_t* v, int width,
+                       const YuvToRgb& k, uint8_t* r, uint8_t* g, uint8_t* b);
+    // The same with full width U and V rows.
+    void (*yuv444_to_rgb)(const uint8_t* y, const uint8_t* u, const uint8_t* v, int width,
+                          const YuvToRgb& k, uint8_t* r, uint8_t* g, uint8_t* b);
+    // The horizontal pass of the resize: dst = src[x0] * w0 + src[x1] * w1 per destination
+    // column, with the (w0, w1) pairs in Q7 at |w|. |src_width| is the row width in pixels.
+    void (*filter_row)(const uint8_t* src, int src_width, const int* x0, const int* x1,
+                       const int16_t* w, int width, int16_t* dst);
+    // The same for packed 3-channel pixels. With |swap_rb| the first and the last channel trade
+    // places.
+    void (*filter_row3)(const uint8_t* src, int src_width, const int* x0, const int* x1,
+                        const int16_t* w, int width, bool swap_rb, int16_t* dst);
+    // The vertical pass: blends two filtered rows, r0 * w[0] + r1 * w[1] with the weights in
+    // Q14, to bytes.
+    void (*blend_rows)(const int16_t* r0, const int16_t* r1, int n, const int16_t* w,
+                       uint8_t* dst);
+};
+
+void NormalizeScalar(const uint8_t* src, int n, float mean, float scale, float* dst) {
+    for (int i = 0; i < n; i++) dst[i] = (src[i] - mean) * scale;
+}
+
+void PackedToPlanarScalar(const uint8_t* src, int width, uint8_t* c0, uint8_t* c1, uint8_t* c2) {
+    for (int x = 0; x < width; x++) {
+        c0[x] = src[3 * x];
+        c1[x] = src[3 * x + 1];
+        c2[x] = src[3 * x + 2];
+    }
+}
+
+void PlanarToPackedScalar(const uint8_t* c0, const uint8_t* c1, const uint8_t* c2, int width,
+                          uint8_t* dst) {
+    for (int x = 0; x < width; x++) {
+        dst[3 * x] = c0[x];
+        dst[3 * x + 1] = c1[x];
+        dst[3 * x + 2] = c2[x];
+    }
+}
+
+void SwapRBScalar(const uint8_t* src, int width, uint8_t* dst) {
+    for (int x = 0; x < width; x++) {
+        const uint8_t c0 = src[3 * x];
+        dst[3 * x + 1] = src[3 * x + 1];
+        dst[3 * x] = src[3 * x + 2];
+        dst[3 * x + 2] = c0;
+    }
+}
+
+// |kChromaShift| is 1 for half width chroma rows and 0 for full width ones.
+template<int kChromaShift>
+void YuvToRgbScalar(const uint8_t* y, const uint8_t* u, const uint8_t* v, int width,
+                    const YuvToRgb& k, uint8_t* r, uint8_t* g, uint8_t* b) {
+    for (int x = 0; x < width; x++) {
+        const int yy = (y[x] - k.y_offset) * k.y_mul;
+        const int uu = u[x >> kChromaShift] - 128;
+        const int vv = v[x >> kChromaShift] - 128;
+        r[x] = ClampQ14(yy + k.rv * vv);
+        g[x] = ClampQ14(yy - k.gu * uu - k.gv * vv);
+        b[x] = ClampQ14(yy + k.bu * uu);
+    }
+}
+
+void FilterRowScalar(const uint8_t* src, int src_width, const int* x0, const int* x1,
+                     const int16_t* w, int width, int16_t* dst) {
+    for (int dx = 0; dx < width; dx++) {
+        dst[dx] = src[x0[dx]] * w[2 * dx] + src[x1[dx]] * w[2 * dx + 1];
+    }
+}
+
+// |kFirst| is the source channel of output channel 0.
+template<int kFirst>
+void FilterRow3Scalar(const uint8_t* src, const int* x0, const int* x1, const int16_t* w,
+                      int width, int16_t* dst) {
+    const int kLast = 2 - kFirst;
+    for (int dx = 0; dx < width; dx++, dst += 3) {
+        const uint8_t* a = src + 3 * x0[dx];
+        const uint8_t* b = src + 3 * x1[dx];
+        const int w0 = w[2 * dx];
+        const int w1 = w[2 * dx + 1];
+        dst[0] = a[kFirst] * w0 + b[kFirst] * w1;
+        dst[1] = a[1] * w0 + b[1] * w1;
+        dst[2] = a[kLast] * w0 + b[kLast] * w1;
+    }
+}
+
+void FilterRow3Scalar(const uint8_t* src, int src_width, const int* x0, const int* x1,
+                      const int16_t* w, int width, bool swap_rb, int16_t* dst) {
+    if (swap_rb) {
+        FilterRow3Scalar<2>(src, x0, x1, w, width, dst);
+    } else {
+        FilterRow3Scalar<0>(src, x0, x1, w, width, dst);
+    }
+}
+
+void BlendRowsScalar(const int16_t* r0, const int16_t* r1, int n, const int16_t* w,
+                     uint8_t* dst) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = (r0[i] * w[0] + r1[i] * w[1] + (1 << (kBlendShift - 1))) >> kBlendShift;
+    }
+}
+
+#ifdef PREPROCESS_X86
+
+// pshufb masks that gather channel |channel| of 16 packed 3-byte pixels out of the 16-byte block
+// |block| of the 48 bytes they occupy. Lanes that come from another block are zeroed (0x80).
+struct DeinterleaveMasks {
+    DeinterleaveMasks() {
+        for (int channel = 0; channel < 3; channel++) {
+            for (int block = 0; block < 3; block++) {
+                for (int i = 0; i < 16; i++) {
+                    const int pos = 3 * i + channel - 16 * block;
+                    mask[channel][block][i] = pos >= 0 && pos < 16 ? pos : 0x80;
+                }
+            }
+        }
+    }
+    uint8_t mask[3][3][16];
+};
+
+// The inverse: byte i of output block |block| comes from plane |channel| if it belongs to it.
+struct InterleaveMasks {
+    InterleaveMasks() {
+        for (int block = 0; block < 3; block++) {
+            for (int channel = 0; channel < 3; channel++) {
+                for (int i = 0; i < 16; i++) {
+                    const int pos = 16 * block + i;
+                    mask[block][channel][i] = pos % 3 == channel ? pos / 3 : 0x80;
+                }
+            }
+        }
+    }
+    uint8_t mask[3][3][16];
+};
+
+const DeinterleaveMasks deinterleave_masks;
+const InterleaveMasks interleave_masks;
+
+__attribute__((target("sse4.1")))
+inline __m128i Shuffle(__m128i v, const uint8_t* mask) {
+    return _mm_shuffle_epi8(v, _mm_loadu_si128(reinterpret_cast<const __m128i*>(mask)));
+}
+
+__attribute__((target("sse4.1")))
+void NormalizeSse41(const uint8_t* src, int n, float mean, float scale, float* dst) {
+    const __m128 vmean = _mm_set1_ps(mean);
+    const __m128 vscale = _mm_set1_ps(scale);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        for (int j = 0; j < 4; j++) {
+            const __m128 f = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(v));
+            _mm_storeu_ps(dst + i + 4 * j, _mm_mul_ps(_mm_sub_ps(f, vmean), vscale));
+            v = _mm_srli_si128(v, 4);
+        }
+    }
+    NormalizeScalar(src + i, n - i, mean, scale, dst + i);
+}
+
+__attribute__((target("sse4.1")))
+void PackedToPlanarSse41(const uint8_t* src, int width, uint8_t* c0, uint8_t* c1, uint8_t* c2) {
+    const auto& m = deinterleave_masks.mask;
+    uint8_t* planes[3] = {c0, c1, c2};
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * x));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * x + 16));
+        const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * x + 32));
+        for (int ch = 0; ch < 3; ch++) {
+            const __m128i v = _mm_or_si128(
+                _mm_or_si128(Shuffle(a, m[ch][0]), Shuffle(b, m[ch][1])), Shuffle(c, m[ch][2]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(planes[ch] + x), v);
+        }
+    }
+    PackedToPlanarScalar(src + 3 * x, width - x, c0 + x, c1 + x, c2 + x);
+}
+
+__attribute__((target("sse4.1")))
+void PlanarToPackedSse41(const uint8_t* c0, const uint8_t* c1, const uint8_t* c2, int width,
+                         uint8_t* dst) {
+    const auto& m = interleave_masks.mask;
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const __m128i p[3] = {
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(c0 + x)),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(c1 + x)),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(c2 + x)),
+        };
+        for (int block = 0; block < 3; block++) {
+            const __m128i v = _mm_or_si128(
+                _mm_or_si128(Shuffle(p[0], m[block][0]), Shuffle(p[1], m[block][1])),
+                Shuffle(p[2], m[block][2]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * x + 16 * block), v);
+        }
+    }
+    PlanarToPackedScalar(c0 + x, c1 + x, c2 + x, width - x, dst + 3 * x);
+}
+
+// Swaps 5 pixels per 16-byte block. The 16th byte is copied unchanged and rewritten by the next
+// block, which keeps the kernel correct in place.
+__attribute__((target("sse4.1")))
+void SwapRBSse41(const uint8_t* src, int width, uint8_t* dst) {
+    const __m128i mask = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+    const int bytes = 3 * width;
+    int i = 0;
+    for (; i + 16 <= bytes; i += 15) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_shuffle_epi8(v, mask));
+    }
+    SwapRBScalar(src + i, (bytes - i) / 3, dst + i);
+}
+
+// 16 pixels per iteration in 32-bit lanes. Packing back to bytes saturates, which does the
+// clamping.
+template<int kChromaShift>
+__attribute__((target("sse4.1")))
+void YuvToRgbSse41(const uint8_t* y, const uint8_t* u, const uint8_t* v, int width,
+                   const YuvToRgb& k, uint8_t* r, uint8_t* g, uint8_t* b) {
+    const __m128i y_offset = _mm_set1_epi32(k.y_offset);
+    const __m128i y_mul = _mm_set1_epi32(k.y_mul);
+    const __m128i rv = _mm_set1_epi32(k.rv);
+    const __m128i gu = _mm_set1_epi32(k.gu);
+    const __m128i gv = _mm_set1_epi32(k.gv);
+    const __m128i bu = _mm_set1_epi32(k.bu);
+    const __m128i c128 = _mm_set1_epi32(128);
+    const __m128i round = _mm_set1_epi32(1 << 13);
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i yv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y + x));
+        __m128i uv, vv;
+        if (kChromaShift == 1) {
+            const __m128i u8 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(u + x / 2));
+            const __m128i v8 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(v + x / 2));
+            uv = _mm_unpacklo_epi8(u8, u8);
+            vv = _mm_unpacklo_epi8(v8, v8);
+        } else {
+            uv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(u + x));
+            vv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(v + x));
+        }
+        __m128i rs[4], gs[4], bs[4];
+        for (int j = 0; j < 4; j++) {
+            const __m128i yj =
+                _mm_mullo_epi32(_mm_sub_epi32(_mm_cvtepu8_epi32(yv), y_offset), y_mul);
+            const __m128i uj = _mm_sub_epi32(_mm_cvtepu8_epi32(uv), c128);
+            const __m128i vj = _mm_sub_epi32(_mm_cvtepu8_epi32(vv), c128);
+            rs[j] = _mm_srai_epi32(
+                _mm_add_epi32(_mm_add_epi32(yj, _mm_mullo_epi32(rv, vj)), round), 14);
+            gs[j] = _mm_srai_epi32(
+                _mm_add_epi32(_mm_sub_epi32(_mm_sub_epi32(yj, _mm_mullo_epi32(gu, uj)),
+                                            _mm_mullo_epi32(gv, vj)),
+                              round), 14);
+            bs[j] = _mm_srai_epi32(
+                _mm_add_epi32(_mm_add_epi32(yj, _mm_mullo_epi32(bu, uj)), round), 14);
+            yv = _mm_srli_si128(yv, 4);
+            uv = _mm_srli_si128(uv, 4);
+            vv = _mm_srli_si128(vv, 4);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(r + x),
+                         _mm_packus_epi16(_mm_packs_epi32(rs[0], rs[1]),
+                                          _mm_packs_epi32(rs[2], rs[3])));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(g + x),
+                         _mm_packus_epi16(_mm_packs_epi32(gs[0], gs[1]),
+                                          _mm_packs_epi32(gs[2], gs[3])));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(b + x),
+                         _mm_packus_epi16(_mm_packs_epi32(bs[0], bs[1]),
+                                          _mm_packs_epi32(bs[2], bs[3])));
+    }
+    YuvToRgbScalar<kChromaShift>(y + x, u + (x >> kChromaShift), v + (x >> kChromaShift),
+                                 width - x, k, r + x, g + x, b + x);
+}
+
+// A pair of int16 weights as one 32-bit lane.
+inline int LoadPair(const void* p) {
+    int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline int16_t LoadBytePair(const uint8_t* p) {
+    int16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Number of leading columns whose source reads stay below column |last| of the row. The right
+// edge is left to the scalar code.
+inline int InnerColumns(const int* x0, int width, int last) {
+    while (width > 0 && x0[width - 1] >= last) width--;
+    return width;
+}
+
+// The vector filters read src[x0] and src[x0 + 1] as one pair. That is x1 wherever its weight
+// is not zero, since BilinearCoeffs only clamps x1 to x0 with a zero weight. pmaddwd then
+// computes src[x0] * w0 + src[x0 + 1] * w1 in 32-bit lanes.
+__attribute__((target("sse4.1")))
+void FilterRowSse41(const uint8_t* src, int src_width, const int* x0, const int* x1,
+                    const int16_t* w, int width, int16_t* dst) {
+    const int end = InnerColumns(x0, width, src_width - 1);
+    int dx = 0;
+    for (; dx + 8 <= end; dx += 8) {
+        const int* x = x0 + dx;
+        const __m128i pairs = _mm_setr_epi16(
+            LoadBytePair(src + x[0]), LoadBytePair(src + x[1]), LoadBytePair(src + x[2]),
+            LoadBytePair(src + x[3]), LoadBytePair(src + x[4]), LoadBytePair(src + x[5]),
+            LoadBytePair(src + x[6]), LoadBytePair(src + x[7]));
+        const __m128i lo = _mm_madd_epi16(
+            _mm_cvtepu8_epi16(pairs),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(w + 2 * dx)));
+        const __m128i hi = _mm_madd_epi16(
+            _mm_unpackhi_epi8(pairs, _mm_setzero_si128()),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(w + 2 * dx + 8)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + dx), _mm_packs_epi32(lo, hi));
+    }
+    FilterRowScalar(src, src_width, x0 + dx, x1 + dx, w + 2 * dx, width - dx, dst + dx);
+}
+
+// Two pixels per iteration. An 8-byte load holds both source pixels, which pshufb spreads to
+// 16-bit pairs per channel. The 16-byte store writes 12 bytes of results and 4 that the next
+// iteration overwrites.
+__attribute__((target("sse4.1")))
+void FilterRow3Sse41(const uint8_t* src, int src_width, const int* x0, const int* x1,
+                     const int16_t* w, int width, bool swap_rb, int16_t* dst) {
+    const char c0 = swap_rb ? 2 : 0;
+    const char c2 = 2 - c0;
+    const __m128i spread =
+        _mm_setr_epi8(c0, -1, 3 + c0, -1, 1, -1, 4, -1, c2, -1, 3 + c2, -1, -1, -1, -1, -1);
+    const __m128i compact =
+        _mm_setr_epi8(0, 1, 2, 3, 4, 5, 8, 9, 10, 11, 12, 13, -1, -1, -1, -1);
+    const int end = InnerColumns(x0, width, src_width - 2);
+    int dx = 0;
+    for (; dx + 3 <= end; dx += 2) {
+        const __m128i a = _mm_shuffle_epi8(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + 3 * x0[dx])), spread);
+        const __m128i b = _mm_shuffle_epi8(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + 3 * x0[dx + 1])), spread);
+        const __m128i lo = _mm_madd_epi16(a, _mm_set1_epi32(LoadPair(w + 2 * dx)));
+        const __m128i hi = _mm_madd_epi16(b, _mm_set1_epi32(LoadPair(w + 2 * dx + 2)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * dx),
+                         _mm_shuffle_epi8(_mm_packs_epi32(lo, hi), compact));
+    }
+    FilterRow3Scalar(src, src_width, x0 + dx, x1 + dx, w + 2 * dx, width - dx, swap_rb,
+                     dst + 3 * dx);
+}
+
+// pmaddwd on the interleaved rows computes r0 * w0 + r1 * w1 per value in 32-bit lanes.
+__attribute__((target("sse4.1")))
+void BlendRowsSse41(const int16_t* r0, const int16_t* r1, int n, const int16_t* wy,
+                    uint8_t* dst) {
+    const __m128i w = _mm_set1_epi32(LoadPair(wy));
+    const __m128i round = _mm_set1_epi32(1 << (kBlendShift - 1));
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i out[2];
+        for (int j = 0; j < 2; j++) {
+            const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r0 + i + 8 * j));
+            const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r1 + i + 8 * j));
+            const __m128i lo = _mm_srai_epi32(
+                _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(a, b), w), round), kBlendShift);
+            const __m128i hi = _mm_srai_epi32(
+                _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(a, b), w), round), kBlendShift);
+            out[j] = _mm_packs_epi32(lo, hi);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(out[0], out[1]));
+    }
+    BlendRowsScalar(r0 + i, r1 + i, n - i, wy, dst + i);
+}
+
+__attribute__((target("avx2")))
+void NormalizeAvx2(const uint8_t* src, int n, float mean, float scale, float* dst) {
+    const __m256 vmean = _mm256_set1_ps(mean);
+    const __m256 vscale = _mm256_set1_ps(scale);
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        for (int j = 0; j < 4; j++) {
+            const __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i + 8 * j));
+            const __m256 f = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v));
+            _mm256_storeu_ps(dst + i + 8 * j, _mm256_mul_ps(_mm256_sub_ps(f, vmean), vscale));
+        }
+    }
+    NormalizeSse41(src + i, n - i, mean, scale, dst + i);
+}
+
+// Unpacking and packing work per 128-bit lane, which keeps the order up to the final pack to
+// bytes. That one interleaves the lanes of its operands, hence the permute.
+__attribute__((target("avx2")))
+void BlendRowsAvx2(const int16_t* r0, const int16_t* r1, int n, const int16_t* wy,
+                   uint8_t* dst) {
+    const __m256i w = _mm256_set1_epi32(LoadPair(wy));
+    const __m256i round = _mm256_set1_epi32(1 << (kBlendShift - 1));
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i out[2];
+        for (int j = 0; j < 2; j++) {
+            const __m256i a =
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(r0 + i + 16 * j));
+            const __m256i b =
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(r1 + i + 16 * j));
+            const __m256i lo = _mm256_srai_epi32(
+                _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w), round),
+                kBlendShift);
+            const __m256i hi = _mm256_srai_epi32(
+                _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w), round),
+                kBlendShift);
+            out[j] = _mm256_packs_epi32(lo, hi);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i),
+                            _mm256_permute4x64_epi64(_mm256_packus_epi16(out[0], out[1]),
+                                                     _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+    BlendRowsSse41(r0 + i, r1 + i, n - i, wy, dst + i);
+}
+
+#endif  // PREPROCESS_X86
+
+Kernels SelectKernels() {
+    const Kernels scalar = {"scalar", NormalizeScalar, PackedToPlanarScalar, PlanarToPackedScalar,
+                            SwapRBScalar, YuvToRgbScalar<1>, YuvToRgbScalar<0>,
+                            FilterRowScalar, FilterRow3Scalar, BlendRowsScalar};
+    std::string limit;
+    if (const char* env = getenv("PREPROCESS_ISA")) limit = env;
+#ifdef PREPROCESS_X86
+    __builtin_cpu_init();
+    // The byte shuffles gain nothing from 256-bit registers since pshufb works per 128-bit lane,
+    // so the AVX2 set reuses them, and the YUV kernel with them. So do the resize filters, whose
+    // loads are per pixel.
+    const Kernels avx2 = {"avx2", NormalizeAvx2, PackedToPlanarSse41, PlanarToPackedSse41,
+                          SwapRBSse41, YuvToRgbSse41<1>, YuvToRgbSse41<0>, FilterRowSse41,
+                          FilterRow3Sse41, BlendRowsAvx2};
+    const Kernels sse41 = {"sse4.1", NormalizeSse41, PackedToPlanarSse41, PlanarToPackedSse41,
+                           SwapRBSse41, YuvToRgbSse41<1>, YuvToRgbSse41<0>, FilterRowSse41,
+                           FilterRow3Sse41, BlendRowsSse41};
+    if (limit != "scalar" && limit != "sse4.1" && __builtin_cpu_supports("avx2")) return avx2;
+    if (limit != "scalar" && __builtin_cpu_supports("sse4.1")) return sse41;
+#endif
+    return scalar;
+}
+
+const Kernels& kernels() {
+    static const Kernels k = SelectKernels();
+    return k;
+}
+
+}  // namespace
+
+const char* PreprocessIsa() {
+    return kernels().isa;
+}
+
+void NormalizeRows(const uint8_t* src, int src_stride, int row_elems, int height, float mean,
+                   float scale, float* dst) {
+    const Kernels& k = kernels();
+    for (int row = 0; row < height; row++) {
+        k.normalize(src, row_elems, mean, scale, dst);
+        src += src_stride;
+        dst += row_elems;
+    }
+}
+
+void CopyRows(const uint8_t* src, int src_stride, int row_bytes, int height, uint8_t* dst,
+              int dst_stride) {
+    if (src_stride == row_bytes && dst_stride == row_bytes) {
+        memcpy(dst, src, static_cast<size_t>(row_bytes) * height);
+        return;
+    }
+    for (int row = 0; row < height; row++) {
+        memcpy(dst, src, row_bytes);
+        src += src_stride;
+        dst += dst_stride;
+    }
+}
+
+void PackedToPlanar(const uint8_t* src, int src_stride, int width, int height, bool swap_rb,
+                    uint8_t* dst) {
+    const Kernels& k = kernels();
+    const size_t plane_size = static_cast<size_t>(width) * height;
+    uint8_t* c0 = dst + (swap_rb ? 2 * plane_size : 0);
+    uint8_t* c1 = dst + plane_size;
+    uint8_t* c2 = dst + (swap_rb ? 0 : 2 * plane_size);
+    for (int row = 0; row < height; row++) {
+        k.packed_to_planar(src, width, c0, c1, c2);
+        src += src_stride;
+        c0 += width;
+        c1 += width;
+        c2 += width;
+    }
+}
+
+void PlanarToPacked(const uint8_t* const planes[3], const int strides[3], int width, int height,
+                    uint8_t* dst, int dst_stride) {
+    const Kernels& k = kernels();
+    for (int row = 0; row < height; row++) {
+        k.planar_to_packed(planes[0] + row * strides[0], planes[1] + row * strides[1],
+                           planes[2] + row * strides[2], width, dst);
+        dst += dst_stride;
+    }
+}
+
+void SwapRB(const uint8_t* src, int src_stride, int width, int height, uint8_t* dst,
+            int dst_stride) {
+    const Kernels& k = kernels();
+    for (int row = 0; row < height; row++) {
+        k.swap_rb(src, width, dst);
+        src += src_stride;
+        dst += dst_stride;
+    }
+}
+
+SourceImage SourceImage::Packed(const uint8_t* data, int stride, bool swap_rb) {
+    SourceImage image;
+    image.format = swap_rb ? kPackedSwapRB : kPacked;
+    image.planes[0] = data;
+    image.strides[0] = stride;
+    image.planes[1] = image.planes[2] = nullptr;
+    image.strides[1] = image.strides[2] = 0;
+    return image;
+}
+
+SourceImage SourceImage::Yuv420(const uint8_t* const planes[3], const int strides[3],
+                                bool full_range) {
+    SourceImage image;
+    image.format = full_range ? kYuvJ420 : kYuv420;
+    for (int i = 0; i < 3; i++) {
+        image.planes[i] = planes[i];
+        image.strides[i] = strides[i];
+    }
+    return image;
+}
+
+namespace {
+
+// Source sample positions for a bilinear resize from |src_size| to |dst_size|, with pixel centers
+// aligned the way cv::resize(INTER_LINEAR) does it. |w| gets the weights of both positions in
+// pairs, with |bits| fractional bits.
+void BilinearCoeffs(int src_size, int dst_size, int bits, std::vector<int>* i0,
+                    std::vector<int>* i1, std::vector<int16_t>* w) {
+    i0->resize(dst_size);
+    i1->resize(dst_size);
+    w->resize(2 * dst_size);
+    const float ratio = static_cast<float>(src_size) / dst_size;
+    for (int d = 0; d < dst_size; d++) {
+        float s = (d + 0.5f) * ratio - 0.5f;
+        if (s < 0) s = 0;
+        int s0 = static_cast<int>(s);
+        float frac = s - s0;
+        if (s0 >= src_size - 1) {
+            s0 = src_size - 1;
+            frac = 0;
+        }
+        (*i0)[d] = s0;
+        (*i1)[d] = s0 < src_size - 1 ? s0 + 1 : s0;
+        const int w1 = static_cast<int>(frac * (1 << bits) + 0.5f);
+        (*w)[2 * d] = (1 << bits) - w1;
+        (*w)[2 * d + 1] = w1;
+    }
+}
+
+// The horizontal pass of the resize for the last two source rows of one plane. Consecutive output
+// rows mostly share source rows, so each is filtered once. With |swap_rb| the first and the last
+// of 3 channels trade places.
+template<int kChannels>
+class FilteredRows {
+  public:
+    FilteredRows(const uint8_t* plane, int stride, int src_width, const std::vector<int>& x0,
+                 const std::vector<int>& x1, const std::vector<int16_t>& wx, int width,
+                 bool swap_rb, int16_t* rows)
+        : kernels_(kernels()), plane_(plane), stride_(stride), src_width_(src_width),
+          x0_(x0.data()), x1_(x1.data()), wx_(wx.data()), width_(width), swap_rb_(swap_rb),
+          rows_{rows, rows + width * kChannels} {}
+
+    // Source row |y| filtered to the output width, in Q7. Row |keep|, which the caller uses
+    // together with it, stays cached.
+    const int16_t* Get(int y, int keep) {
+        for (int i = 0; i < 2; i++) {
+            if (index_[i] == y) return rows_[i];
+        }
+        const int i = index_[0] == keep ? 1 : 0;
+        index_[i] = y;
+        const uint8_t* src = plane_ + static_cast<size_t>(y) * stride_;
+        if (kChannels == 3) {
+            kernels_.filter_row3(src, src_width_, x0_, x1_, wx_, width_, swap_rb_, rows_[i]);
+        } else {
+            kernels_.filter_row(src, src_width_, x0_, x1_, wx_, width_, rows_[i]);
+        }
+        return rows_[i];
+    }
+
+  private:
+    const Kernels& kernels_;
+    const uint8_t* const plane_;
+    const int stride_;
+    const int src_width_;
+    const int* const x0_;
+    const int* const x1_;
+    const int16_t* const wx_;
+    const int width_;
+    const bool swap_rb_;
+    int16_t* const rows_[2];
+    int index_[2] = {-1, -1};
+};
+
+// Y to gray for 1-channel models.
+struct LumaToGray {
+    explicit LumaToGray(const YuvToRgb& k) {
+        for (int y = 0; y < 256; y++) table[y] = ClampQ14((y - k.y_offset) * k.y_mul);
+    }
+    uint8_t table[256];
+};
+
+// Working rows of InputResizer::Run. One set per thread since the resizer is shared, and kept
+// so that frames after the first allocate nothing.
+struct ResizeScratch {
+    std::vector<int16_t> filtered;
+    std::vector<uint8_t> bytes;
+};
+
+}  // namespace
+
+void Yuv420ToPacked(const SourceImage& src, int width, int height, bool bgr, uint8_t* dst,
+                    int dst_stride) {
+    const Kernels& kern = kernels();
+    const YuvToRgb& k = src.format == SourceImage::kYuvJ420 ? kFullRange : kLimitedRange;
+    // Convert a row to R, G and B rows, then interleave them. The rows are kept per thread, so
+    // only the first frame of a size allocates them.
+    thread_local std::vector<uint8_t> rows;
+    rows.resize(3 * width);
+    uint8_t* rgb[3] = {rows.data(), rows.data() + width, rows.data() + 2 * width};
+    for (int row = 0; row < height; row++) {
+        kern.yuv_to_rgb(src.planes[0] + row * src.strides[0],
+                        src.planes[1] + (row / 2) * src.strides[1],
+                        src.planes[2] + (row / 2) * src.strides[2], width, k, rgb[0], rgb[1],
+                        rgb[2]);
+        kern.planar_to_packed(rgb[bgr ? 2 : 0], rgb[1], rgb[bgr ? 0 : 2], width,
+                              dst + row * dst_stride);
+    }
+}
+
+InputResizer::InputResizer(int src_width, int src_height, int dst_width, int dst_height,
+                           int channels)
+    : src_width_(src_width), src_height_(src_height), dst_width_(dst_width),
+      dst_height_(dst_height), channels_(channels) {
+    BilinearCoeffs(src_width, dst_width, kWeightBitsX, &x0_, &x1_, &wx_);
+    BilinearCoeffs(src_height, dst_height, kWeightBitsY, &y0_, &y1_, &wy_);
+    BilinearCoeffs((src_width + 1) / 2, dst_width, kWeightBitsX, &cx0_, &cx1_, &cwx_);
+    BilinearCoeffs((src_height + 1) / 2, dst_height, kWeightBitsY, &cy0_, &cy1_, &cwy_);
+}
+
+template<int kChannels, typename Emit>
+void InputResizer::Run(const SourceImage& src, uint8_t* dst, Emit emit) const {
+    const Kernels& kern = kernels();
+    const int row_elems = dst_width_ * kChannels;
+    thread_local ResizeScratch scratch;
+    if (!src.is_yuv()) {
+        scratch.filtered.resize(2 * row_elems);
+        scratch.bytes.resize(row_elems);
+        FilteredRows<kChannels> rows(src.planes[0], src.strides[0], src_width_, x0_, x1_, wx_,
+                                     dst_width_, src.format == SourceImage::kPackedSwapRB,
+                                     scratch.filtered.data());
+        for (int dy = 0; dy < dst_height_; dy++) {
+            uint8_t* row = dst != nullptr ? dst + static_cast<size_t>(dy) * row_elems
+                                          : scratch.bytes.data();
+            kern.blend_rows(rows.Get(y0_[dy], y1_[dy]), rows.Get(y1_[dy], y0_[dy]), row_elems,
+                            &wy_[2 * dy], row);
+            emit(dy, row);
+        }
+        return;
+    }
+
+    // Y, U and V are resized as planes, all to the output size, then converted to RGB.
+    const YuvToRgb& k = src.format == SourceImage::kYuvJ420 ? kFullRange : kLimitedRange;
+    const int width = dst_width_;
+    scratch.filtered.resize(6 * width);
+    scratch.bytes.resize(9 * width);
+    int16_t* filtered = scratch.filtered.data();
+    const int chroma_width = (src_width_ + 1) / 2;
+    FilteredRows<1> y_rows(src.planes[0], src.strides[0], src_width_, x0_, x1_, wx_, width, false,
+                           filtered);
+    FilteredRows<1> u_rows(src.planes[1], src.strides[1], chroma_width, cx0_, cx1_, cwx_, width,
+                           false, filtered + 2 * width);
+    FilteredRows<1> v_rows(src.planes[2], src.strides[2], chroma_width, cx0_, cx1_, cwx_, width,
+                           false, filtered + 4 * width);
+    uint8_t* y = scratch.bytes.data();
+    uint8_t* u = y + width;
+    uint8_t* v = u + width;
+    uint8_t* rgb[3] = {v + width, v + 2 * width, v + 3 * width};
+    uint8_t* packed = rgb[2] + width;
+    static const LumaToGray limited_gray(kLimitedRange);
+    static const LumaToGray full_gray(kFullRange);
+    const uint8_t* gray = (&k == &kFullRange ? full_gray : limited_gray).table;
+    for (int dy = 0; dy < dst_height_; dy++) {
+        uint8_t* row = dst != nullptr ? dst + static_cast<size_t>(dy) * row_elems
+                                      : kChannels == 1 ? y : packed;
+        if (kChannels == 1) {
+            kern.blend_rows(y_rows.Get(y0_[dy], y1_[dy]), y_rows.Get(y1_[dy], y0_[dy]), width,
+                            &wy_[2 * dy], row);
+            for (int x = 0; x < width; x++) row[x] = gray[row[x]];
+            emit(dy, row);
+            continue;
+        }
+        kern.blend_rows(y_rows.Get(y0_[dy], y1_[dy]), y_rows.Get(y1_[dy], y0_[dy]), width,
+                        &wy_[2 * dy], y);
+        kern.blend_rows(u_rows.Get(cy0_[dy], cy1_[dy]), u_rows.Get(cy1_[dy], cy0_[dy]), width,
+                        &cwy_[2 * dy], u);
+        kern.blend_rows(v_rows.Get(cy0_[dy], cy1_[dy]), v_rows.Get(cy1_[dy], cy0_[dy]), width,
+                        &cwy_[2 * dy], v);
+        kern.yuv444_to_rgb(y, u, v, width, k, rgb[0], rgb[1], rgb[2]);
+        kern.planar_to_packed(rgb[0], rgb[1], rgb[2], width, row);
+        emit(dy, row);
+    }
+}
+
+void InputResizer::Resize(const SourceImage& src, float mean, float scale, float* dst) const {
+    const int row_elems = dst_width_ * channels_;
+    if (same_size() && src.format == SourceImage::kPacked) {
+        NormalizeRows(src.planes[0], src.strides[0], row_elems, dst_height_, mean, scale, dst);
+        return;
+    }
+    const Kernels& kern = kernels();
+    auto normalize = [&](int dy, const uint8_t* row) {
+        kern.normalize(row, row_elems, mean, scale, dst + static_cast<size_t>(dy) * row_elems);
+    };
+    if (channels_ == 3) {
+        Run<3>(src, nullptr, normalize);
+    } else {
+        Run<1>(src, nullptr, normalize);
+    }
+}
+
+void InputResizer::Resize(const SourceImage& src, uint8_t* dst) const {
+    const int row_bytes = dst_width_ * channels_;
+    if (same_size() && src.format == SourceImage::kPacked) {
+        CopyRows(src.planes[0], src.strides[0], row_bytes, dst_height_, dst, row_bytes);
+        return;
+    }
+    if (same_size() && src.format == SourceImage::kPackedSwapRB && channels_ == 3) {
+        SwapRB(src.planes[0], src.strides[0], dst_width_, dst_height_, dst, row_bytes);
+        return;
+    }
+    auto done = [](int, const uint8_t*) {};
+    if (channels_ == 3) {
+        Run<3>(src, dst, done);
+    } else {
+        Run<1>(src, dst, done);
+    }
+}
+
+void InputResizer::ResizePlanar(const SourceImage& src, uint8_t* dst) const {
+    if (channels_ == 1) {
+        Resize(src, dst);
+        return;
+    }
+    if (same_size() && !src.is_yuv()) {
+        PackedToPlanar(src.planes[0], src.strides[0], dst_width_, dst_height_,
+                       src.format == SourceImage::kPackedSwapRB, dst);
+        return;
+    }
+    const Kernels& kern = kernels();
+    const size_t plane_size = static_cast<size_t>(dst_width_) * dst_height_;
+    Run<3>(src, nullptr, [&](int dy, const uint8_t* row) {
+        uint8_t* c0 = dst + static_cast<size_t>(dy) * dst_width_;
+        kern.packed_to_planar(row, dst_width_, c0, c0 + plane_size, c0 + 2 * plane_size);
+    });
+}
@@ -0,0 +1,106 @@
+#ifndef PREPROCESS_HPP_
+#define PREPROCESS_HPP_
+
+#include <stdint.h>
+
+#include <vector>
+
+// Pixel conversion kernels shared by the benchmarks.
+//
+// Every kernel works on whole images given as a pointer plus a row stride in bytes, so it can
+// read AVFrame planes (whose linesize is padded) and cv::Mat rows directly. On first use the
+// widest implementation the CPU supports is picked: AVX2, SSE4.1 or plain C++. Setting the
+// PREPROCESS_ISA environment variable to "scalar", "sse4.1" or "avx2" caps the choice, which is
+// useful to compare them.
+
+// Name of the implementation in use, e.g. "avx2".
+const char* PreprocessIsa();
+
+// dst = (src - mean) * scale for |height| rows of |row_elems| values. Destination rows are packed.
+void NormalizeRows(const uint8_t* src, int src_stride, int row_elems, int height, float mean,
+                   float scale, float* dst);
+
+// Copies |height| rows of |row_bytes| bytes.
+void CopyRows(const uint8_t* src, int src_stride, int row_bytes, int height, uint8_t* dst,
+              int dst_stride);
+
+// Splits a packed 3-channel image (HWC) into three packed planes (CHW) at |dst|. With |swap_rb|
+// the first and the last channel trade places, e.g. BGR in and RGB planes out.
+void PackedToPlanar(const uint8_t* src, int src_stride, int width, int height, bool swap_rb,
+                    uint8_t* dst);
+
+// Interleaves three planes into a packed 3-channel image (CHW to HWC). |planes| and |strides|
+// are given in output channel order.
+void PlanarToPacked(const uint8_t* const planes[3], const int strides[3], int width, int height,
+                    uint8_t* dst, int dst_stride);
+
+// Swaps the first and the last channel of a packed 3-channel image (RGB <-> BGR). |src| and
+// |dst| may be the same image.
+void SwapRB(const uint8_t* src, int src_stride, int width, int height, uint8_t* dst,
+            int dst_stride);
+
+// The image an InputResizer reads from.
+struct SourceImage {
+    enum Format {
+        // RGB, or gray for 1-channel models.
+        kPacked,
+        // BGR, swapped to RGB while reading.
+        kPackedSwapRB,
+        // Y, U and V planes in limited (MPEG) range, converted to RGB while reading (BT.601).
+        kYuv420,
+        // The same in full (JPEG) range.
+        kYuvJ420,
+    };
+
+    static SourceImage Packed(const uint8_t* data, int stride, bool swap_rb);
+    static SourceImage Yuv420(const uint8_t* const planes[3], const int strides[3],
+                              bool full_range);
+
+    bool is_yuv() const { return format == kYuv420 || format == kYuvJ420; }
+
+    Format format;
+    const uint8_t* planes[3];
+    int strides[3];
+};
+
+// Converts a YUV 4:2:0 |src| of width x height to a packed image of the same size, in BGR order
+// if |bgr| and RGB otherwise. Chroma is taken from the nearest sample.
+void Yuv420ToPacked(const SourceImage& src, int width, int height, bool bgr, uint8_t* dst,
+                    int dst_stride);
+
+// Bilinear resize fused with the conversion to RGB and to the model input type. A decoded frame
+// is read once and the input written once, with no intermediate image. The arithmetic is fixed
+// point, as in cv::resize, so results may differ slightly from a float resize.
+// Build one per source size and reuse it. The Resize calls are const and may run concurrently.
+class InputResizer {
+  public:
+    // |channels| is 1 or 3. A 1-channel model gets the Y plane of YUV sources.
+    InputResizer(int src_width, int src_height, int dst_width, int dst_height, int channels);
+
+    int src_width() const { return src_width_; }
+    int src_height() const { return src_height_; }
+
+    // Packed (HWC) float output, (v - mean) * scale.
+    void Resize(const SourceImage& src, float mean, float scale, float* dst) const;
+    // Packed (HWC) uint8 output.
+    void Resize(const SourceImage& src, uint8_t* dst) const;
+    // Planar (CHW) uint8 output.
+    void ResizePlanar(const SourceImage& src, uint8_t* dst) const;
+
+  private:
+    // Resizes |src| a row at a time: filters the two nearest source rows along x, blends them and
+    // converts the result to packed uint8 RGB, or gray. Calls emit(output row, row) for each,
+    // with the row written to |dst| at its place if |dst| is not null and to scratch otherwise.
+    template<int kChannels, typename Emit>
+    void Run(const SourceImage& src, uint8_t* dst, Emit emit) const;
+
+    bool same_size() const { return src_width_ == dst_width_ && src_height_ == dst_height_; }
+
+    const int src_width_, src_height_, dst_width_, dst_height_, channels_;
+    // Per destination column: the two neighbouring source columns and the fixed point weights of
+    // both, in pairs. The same per destination row, and for the chroma planes of YUV sources.
+    std::vector<int> x0_, x1_, y0_, y1_, cx0_, cx1_, cy0_, cy1_;
+    std::vector<int16_t> wx_, wy_, cwx_, cwy_;
+};
+
+#endif  // PREPROCESS_HPP_
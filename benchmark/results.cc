@@ -0,0 +1,170 @@
+#include "results.hpp"
+
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <glog/logging.h>
+
+DEFINE_string(results_json, "",
+              "If not empty, write the results of all runs to this file as JSON, e.g. to compare "
+              "them with compare_results.py.");
+
+namespace {
+
+struct Entry {
+    BenchmarkResult result;
+    // Of a Google benchmark function, 0 for other results.
+    int64_t iterations = 0;
+};
+
+std::mutex results_mutex;
+std::vector<Entry> results;
+
+// The same identity as key_of in compare_results.py.
+bool SameBenchmark(const BenchmarkResult& a, const BenchmarkResult& b) {
+    return a.name == b.name && a.model == b.model && a.backend == b.backend &&
+           a.threads == b.threads && a.batch_size == b.batch_size && a.width == b.width &&
+           a.height == b.height && a.config == b.config;
+}
+
+// The "model name" of the first core in /proc/cpuinfo, empty if there is none.
+std::string CpuModel() {
+    std::ifstream file("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.compare(0, 10, "model name") != 0) continue;
+        const size_t colon = line.find(':');
+        if (colon == std::string::npos) break;
+        const size_t start = line.find_first_not_of(' ', colon + 1);
+        return start == std::string::npos ? "" : line.substr(start);
+    }
+    return "";
+}
+
+std::string JsonString(const std::string& s) {
+    std::string out = "\"";
+    for (const char c : s) {
+        switch (c) {
+            case '"':
+                out += "\\\"";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            case '\t':
+                out += "\\t";
+                break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out + "\"";
+}
+
+// JSON has no NaN or infinity.
+std::string JsonNumber(double value) {
+    if (!isfinite(value)) return "null";
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.9g", value);
+    return buf;
+}
+
+void WriteResult(const BenchmarkResult& result, FILE* file) {
+    fprintf(file, "{\"name\":%s,\"model\":%s,\"backend\":%s,\"threads\":%d,\"batch_size\":%d,"
+            "\"width\":%d,\"height\":%d,\"config\":{",
+            JsonString(result.name).c_str(), JsonString(result.model).c_str(),
+            JsonString(result.backend).c_str(), result.threads, result.batch_size, result.width,
+            result.height);
+    const char* sep = "";
+    for (const auto& entry : result.config) {
+        fprintf(file, "%s%s:%s", sep, JsonString(entry.first).c_str(),
+                JsonString(entry.second).c_str());
+        sep = ",";
+    }
+    const LatencyRecorder& latency = result.latency;
+    fprintf(file, "},\"frames\":%lld,\"wall_ms\":%s,\"fps\":%s,\"latency_ms\":{\"count\":%lld,"
+            "\"mean\":%s,\"p50\":%s,\"p95\":%s,\"p99\":%s,\"max\":%s},\"counters\":{",
+            (long long)result.frames, JsonNumber(result.wall_secs * 1000).c_str(),
+            JsonNumber(result.wall_secs > 0 ? result.frames / result.wall_secs : 0).c_str(),
+            (long long)latency.count(), JsonNumber(latency.mean_ms()).c_str(),
+            JsonNumber(latency.PercentileMs(50)).c_str(),
+            JsonNumber(latency.PercentileMs(95)).c_str(),
+            JsonNumber(latency.PercentileMs(99)).c_str(), JsonNumber(latency.max_ms()).c_str());
+    sep = "";
+    for (const auto& entry : result.counters) {
+        fprintf(file, "%s%s:%s", sep, JsonString(entry.first).c_str(),
+                JsonNumber(entry.second).c_str());
+        sep = ",";
+    }
+    fputs("}}", file);
+}
+
+}  // namespace
+
+void AddResult(const BenchmarkResult& result) {
+    AddBenchmarkResult(result, 0);
+}
+
+void AddBenchmarkResult(const BenchmarkResult& result, int64_t iterations) {
+    std::lock_guard<std::mutex> lock(results_mutex);
+    if (iterations > 0 && !results.empty()) {
+        Entry& last = results.back();
+        if (last.iterations > 0 && last.iterations < iterations &&
+            SameBenchmark(last.result, result)) {
+            last.result = result;
+            last.iterations = iterations;
+            return;
+        }
+    }
+    results.emplace_back();
+    results.back().result = result;
+    results.back().iterations = iterations;
+}
+
+bool WriteResults() {
+    if (FLAGS_results_json.empty()) return true;
+    FILE* file = fopen(FLAGS_results_json.c_str(), "w");
+    if (file == nullptr) {
+        LOG(ERROR) << "Failed to open " << FLAGS_results_json;
+        return false;
+    }
+    char date[32];
+    const time_t now = time(nullptr);
+    struct tm tm;
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&now, &tm));
+    fprintf(file, "{\"context\":{\"binary\":%s,\"command_line\":%s,\"cpu\":%s,\"cpus\":%u,"
+            "\"date\":\"%s\"},\n\"results\":[",
+            JsonString(google::ProgramInvocationShortName()).c_str(),
+            JsonString(google::GetArgv()).c_str(), JsonString(CpuModel()).c_str(),
+            std::thread::hardware_concurrency(), date);
+    {
+        std::lock_guard<std::mutex> lock(results_mutex);
+        for (size_t i = 0; i < results.size(); i++) {
+            fputs(i > 0 ? ",\n" : "\n", file);
+            WriteResult(results[i].result, file);
+        }
+    }
+    fputs("\n]}\n", file);
+    const bool ok = !ferror(file);
+    if (fclose(file) != 0 || !ok) {
+        LOG(ERROR) << "Failed to write " << FLAGS_results_json;
+        return false;
+    }
+    printf("Results written to %s.\n", FLAGS_results_json.c_str());
+    return true;
+}
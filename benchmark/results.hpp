@@ -0,0 +1,55 @@
+#ifndef RESULTS_HPP_
+#define RESULTS_HPP_
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+#include <gflags/gflags.h>
+
+#include "latency_recorder.hpp"
+
+// Machine readable results of the benchmarks, shared by every binary. Each run is added as a
+// BenchmarkResult and all of them are written to --results_json when the binary is done, for
+// compare_results.py to diff two sets of runs.
+
+DECLARE_string(results_json);
+
+// One measured run. Runs of a binary with the same name and configuration are repetitions of
+// one benchmark, and the comparison of two sets of runs is based on their spread.
+struct BenchmarkResult {
+    // Tells the benchmark apart from the others of its binary, e.g. the video it ran.
+    std::string name;
+    std::string model;
+    std::string backend;
+    // Threads a single inference may use, 0 if the engine decides.
+    int threads = 0;
+    int batch_size = 1;
+    // Model input size.
+    int width = 0;
+    int height = 0;
+    // Further settings that tell runs of the same model apart, e.g. {"delegate", "xnnpack"}.
+    std::map<std::string, std::string> config;
+
+    int64_t frames = 0;
+    double wall_secs = 0;
+    // Per inference, or per training step.
+    LatencyRecorder latency;
+    // Whatever else the benchmark counts, e.g. correct and wrong for classification.
+    std::map<std::string, double> counters;
+};
+
+// Keeps |result| until WriteResults. Thread-safe.
+void AddResult(const BenchmarkResult& result);
+
+// The same for the result of one call of a Google benchmark function, which ran |iterations|
+// iterations. The library calls it with more and more iterations until the benchmark runs long
+// enough, so this replaces the previous result if that is of the same benchmark and ran fewer.
+void AddBenchmarkResult(const BenchmarkResult& result, int64_t iterations);
+
+// Writes the results added so far, the command line and the CPU they ran on to --results_json.
+// Does nothing if it is empty.
+bool WriteResults();
+
+#endif  // RESULTS_HPP_
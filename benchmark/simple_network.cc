@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <chrono>
 #include <iomanip>
 #include <limits>
 
@@ -31,11 +32,11 @@ inline std::string LayerZ(int l) { return Sprintf("l%d_z", l); }
 
 inline std::string LayerA(int l) { return Sprintf("l%d_a", l); }
 
-tf::SessionOptions SessionOptions() {
+tf::SessionOptions SessionOptions(int intra_op_threads, int inter_op_threads) {
     tensorflow::SessionOptions sess_opts;
     sess_opts.config.mutable_device_count()->insert({"CPU", 1});
-    sess_opts.config.set_intra_op_parallelism_threads(1);
-    sess_opts.config.set_inter_op_parallelism_threads(1);
+    sess_opts.config.set_intra_op_parallelism_threads(intra_op_threads);
+    sess_opts.config.set_inter_op_parallelism_threads(inter_op_threads);
     sess_opts.config.set_allow_soft_placement(1);
     sess_opts.config.set_isolate_session_state(1);
     return sess_opts;
@@ -43,9 +44,11 @@ tf::SessionOptions SessionOptions() {
 
 }  // namespace
 
-SimpleNetwork::SimpleNetwork(const std::vector<Layer>& layers, int mini_batch_size)
+SimpleNetwork::SimpleNetwork(const std::vector<Layer>& layers, int mini_batch_size,
+                             int intra_op_threads, int inter_op_threads)
     : layers_(layers), mini_batch_size_(mini_batch_size),
-      scope_(tf::Scope::NewRootScope().ExitOnError()), session_(scope_, SessionOptions()),
+      scope_(tf::Scope::NewRootScope().ExitOnError()),
+      session_(scope_, SessionOptions(intra_op_threads, inter_op_threads)),
       inputs_(scope_.WithOpName(INPUTS), tf::DT_FLOAT,
               tf::ops::Placeholder::Shape({mini_batch_size_, layers[0].num_neurons})),
       labels_(scope_.WithOpName(LABELS), tf::DT_INT32,
@@ -76,7 +79,8 @@ SimpleNetwork::SimpleNetwork(const std::vector<Layer>& layers, int mini_batch_si
 
 void SimpleNetwork::Train(
     const std::vector<Case>& training_data, size_t num_samples_per_epoch, size_t epochs,
-    float weight_decay, float learning_rate, const std::vector<Case>* testing_data) {
+    float weight_decay, float learning_rate, const std::vector<Case>* testing_data,
+    std::vector<EpochStats>* epoch_stats) {
     // Add layers.
     std::vector<tf::Output> inits;
     std::vector<std::string> param_names;
@@ -190,6 +194,8 @@ void SimpleNetwork::Train(
             if (step > 0) std::swap(indices[i], indices[i + step]);
         }
         int32_t total = 0, corrects = 0;
+        EpochStats stats;
+        const auto epoch_start = std::chrono::steady_clock::now();
         for (int k = 0; k <= n - mini_batch_size_; k += mini_batch_size_) {
             for (int i = 0; i < mini_batch_size_; i++) {
                 const auto& c = training_data[indices[k+i]];
@@ -197,12 +203,18 @@ void SimpleNetwork::Train(
                        input_size_ * sizeof(float));
                 raw_batch_labels[i] = c.second;
             }
+            const auto step_start = std::chrono::steady_clock::now();
             const auto status = session_.Run(
                 {{inputs_, batch_inputs}, {labels_, batch_labels}}, objectives, &outputs);
+            stats.step_latency.Record(std::chrono::steady_clock::now() - step_start);
             CHECK(status.ok()) << status.ToString();
             total += mini_batch_size_;
             corrects += outputs[0].scalar<int32_t>()(0);
         }
+        stats.secs =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - epoch_start).count();
+        stats.train_corrects = corrects;
+        stats.train_total = total;
         VLOG(0) << "Epoch " << e + 1 << " training accuracy: " << std::setprecision(4)
             << (float)corrects / total << "(" << corrects << "/" << total << ").";
         if (testing_data) {
@@ -210,7 +222,10 @@ void SimpleNetwork::Train(
             LOG(INFO) << "Epoch " << e + 1 << " testing accuracy: " << std::setprecision(4)
                 << (float)result.first / result.second
                 << "(" << result.first << "/" << result.second << ").";
+            stats.test_corrects = result.first;
+            stats.test_total = result.second;
         }
+        if (epoch_stats) epoch_stats->push_back(stats);
     }
 }
 
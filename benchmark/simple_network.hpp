@@ -10,6 +10,8 @@
 #include <tensorflow/cc/client/client_session.h>
 #include <tensorflow/cc/ops/standard_ops.h>
 
+#include "latency_recorder.hpp"
+
 namespace tf = tensorflow;
 
 // A simple neural network implementation using only full-connected neurals.
@@ -29,11 +31,28 @@ class SimpleNetwork {
 
     typedef std::pair<Eigen::RowVectorXf, int> Case;
 
-    SimpleNetwork(const std::vector<Layer>& layers, int mini_batch_size);
+    // How long an epoch of Train took, and how well the network did after it.
+    struct EpochStats {
+        double secs = 0;
+        // Per mini batch.
+        LatencyRecorder step_latency;
+        int32_t train_corrects = 0;
+        int32_t train_total = 0;
+        // 0 without testing data. Testing is not part of |secs|.
+        int32_t test_corrects = 0;
+        int32_t test_total = 0;
+    };
+
+    // The session runs each op on up to |intra_op_threads| threads, and independent ops on up to
+    // |inter_op_threads| threads.
+    SimpleNetwork(const std::vector<Layer>& layers, int mini_batch_size, int intra_op_threads,
+                  int inter_op_threads);
 
+    // Adds the stats of every epoch to |epoch_stats| unless it is null.
     void Train(
         const std::vector<Case>& training_data, size_t num_samples_per_epoch, size_t epochs,
-        float weight_decay, float learning_rate, const std::vector<Case>* testing_data);
+        float weight_decay, float learning_rate, const std::vector<Case>* testing_data,
+        std::vector<EpochStats>* epoch_stats = nullptr);
 
     std::pair<int32_t, int32_t> Evaluate(const std::vector<Case>& testing_data);
 
@@ -1,13 +1,38 @@
 #include "test_video.hpp"
 
+#include <math.h>
 #include <stdlib.h>
 
+#include <algorithm>
+#include <chrono>
 #include <string>
 
 #include <glog/logging.h>
 
-TestVideo::TestVideo(enum AVPixelFormat pix_fmt, uint32_t width, uint32_t height)
-    : pix_fmt_(pix_fmt), width_(width), height_(height) {}
+std::vector<VideoSegment> SplitAtKeyframes(const std::vector<int64_t>& keyframe_pts, int count) {
+    std::vector<VideoSegment> segments;
+    if (keyframe_pts.empty()) {
+        segments.push_back({AV_NOPTS_VALUE, AV_NOPTS_VALUE});
+        return segments;
+    }
+    const int64_t first = keyframe_pts.front();
+    const int64_t last = keyframe_pts.back();
+    int64_t start = first;
+    for (int i = 1; i < count; i++) {
+        // Cut at the first keyframe at or after the ideal point.
+        const int64_t target = first + (last - first) * i / count;
+        auto it = std::lower_bound(keyframe_pts.begin(), keyframe_pts.end(), target);
+        if (it == keyframe_pts.end() || *it <= start) continue;
+        segments.push_back({start, *it});
+        start = *it;
+    }
+    segments.push_back({start, AV_NOPTS_VALUE});
+    return segments;
+}
+
+TestVideo::TestVideo(enum AVPixelFormat pix_fmt, uint32_t width, uint32_t height,
+                     const DecodeOptions& options)
+    : pix_fmt_(pix_fmt), options_(options), width_(width), height_(height) {}
 
 TestVideo::~TestVideo() {
     avfilter_graph_free(&graph_);
@@ -40,12 +65,33 @@ bool TestVideo::Init(const std::string& file, const char* format, bool keep_ar)
         return false;
     }
 
+    int thread_type = 0;
+    if (options_.thread_type == "frame") {
+        thread_type = FF_THREAD_FRAME;
+    } else if (options_.thread_type == "slice") {
+        thread_type = FF_THREAD_SLICE;
+    } else if (options_.thread_type == "auto") {
+        thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    } else {
+        LOG(ERROR) << "Unknown decode thread type " << options_.thread_type;
+        return false;
+    }
+
+    if (options_.every_nth < 1) {
+        LOG(ERROR) << "Invalid every_nth " << options_.every_nth;
+        return false;
+    }
+    if (options_.every_nth > 1 && options_.target_fps > 0) {
+        LOG(ERROR) << "Only one of every_nth and target_fps can be set";
+        return false;
+    }
+
     // Find video stream.
     const int nb_streams = fmt_ctx_->nb_streams;
     AVDictionary** options_array = new AVDictionary*[nb_streams];
     for (int i = 0; i < nb_streams; ++i) {
         options_array[i] = nullptr;
-        av_dict_set(options_array + i, "threads", "1", 0);
+        av_dict_set_int(options_array + i, "threads", options_.threads, 0);
         av_dict_set(options_array + i, "ec", "0", 0);
         av_dict_set(options_array + i, "err_detect", "explode", 0);
     }
@@ -82,12 +128,26 @@ bool TestVideo::Init(const std::string& file, const char* format, bool keep_ar)
         LOG(ERROR) << "avcodec_parameters_to_context failed: " << FfmpegErrStr(rc);
         return false;
     }
-    // Don't use multiple threads, which will actually increase CPU usage.
-    dec_ctx_->thread_count = 1;
+    // More threads cost some CPU in synchronization, so only use them when decoding can't keep up
+    // otherwise.
+    dec_ctx_->thread_count = options_.threads;
+    dec_ctx_->thread_type = thread_type;
     dec_ctx_->error_concealment = 0;
     // Quit decoding if there are errors, which is usually caused by packet loss.
     // This way, we won't have these corrupted frames that only mess up motion detection.
     dec_ctx_->err_recognition = AV_EF_EXPLODE;
+    if (options_.keyframes_only) {
+        dec_ctx_->skip_frame = AVDISCARD_NONKEY;
+    } else if (options_.target_fps > 0) {
+        sample_interval_ = std::max<int64_t>(
+            1, llrint(1 / (options_.target_fps * av_q2d(video_->time_base))));
+        // Typical GOPs have at least one referenced frame in three. Leaving a wide margin, frames
+        // that no other frame refers to are not needed to keep the target rate.
+        const double fps = av_q2d(video_->avg_frame_rate);
+        if (fps > 0 && options_.target_fps * 4 <= fps) {
+            dec_ctx_->skip_frame = AVDISCARD_NONREF;
+        }
+    }
     rc = avcodec_open2(dec_ctx_, codec, &options);
     av_dict_free(&options);
     if (rc < 0) {
@@ -101,14 +161,6 @@ bool TestVideo::Init(const std::string& file, const char* format, bool keep_ar)
     }
     pkt_ = av_packet_alloc();
 
-    // Create filter graph.
-    graph_ = avfilter_graph_alloc();
-    if (graph_ == nullptr) {
-        LOG(ERROR) << "avfilter_graph_alloc failed!";
-        return false;
-    }
-    av_opt_set_int(graph_, "threads", 1, 0);
-    // Create "buffer" filter.
     const enum AVPixelFormat pix_fmt = static_cast<enum AVPixelFormat>(video_->codecpar->format);
     const uint32_t width = video_->codecpar->width;
     const uint32_t height = video_->codecpar->height;
@@ -122,6 +174,23 @@ bool TestVideo::Init(const std::string& file, const char* format, bool keep_ar)
         // Keep aspect ratio.
         height_ = height * width_ / width;
     }
+    // yuvj420p only differs from yuv420p in its range, which the frame's users can handle.
+    const bool same_fmt = pix_fmt == pix_fmt_ ||
+        (pix_fmt_ == AV_PIX_FMT_YUV420P && pix_fmt == AV_PIX_FMT_YUVJ420P);
+    if (same_fmt && width_ == width && height_ == height) {
+        // Nothing to convert, so hand out the decoded frames as they are.
+        VLOG(1) << "Using decoded frames directly";
+        return true;
+    }
+
+    // Create filter graph.
+    graph_ = avfilter_graph_alloc();
+    if (graph_ == nullptr) {
+        LOG(ERROR) << "avfilter_graph_alloc failed!";
+        return false;
+    }
+    av_opt_set_int(graph_, "threads", options_.filter_threads, 0);
+    // Create "buffer" filter.
     const AVFilter* buffersrc  = avfilter_get_by_name("buffer");
     const std::string buffersrc_args = Sprintf(
         "video_size=%dx%d:pix_fmt=%s:time_base=1/90000", width, height,
@@ -204,62 +273,209 @@ bool TestVideo::Init(const std::string& file, const char* format, bool keep_ar)
     return true;
 }
 
-AVFrame* TestVideo::NextFrame() {
-    // Read packet if needed.
-    while (need_pkt_) {
-        if (!ReadPacket()) return nullptr;
-        const int rc = avcodec_send_packet(dec_ctx_, pkt_);
-        if (rc < 0 && rc != AVERROR_EOF) {
-            LOG(WARNING) << "avcodec_send_packet failed: " << FfmpegErrStr(rc);
+bool TestVideo::NextFrame(FrameHandle* frame) {
+    const auto start = std::chrono::steady_clock::now();
+    const bool ok = Decode(frame);
+    decode_secs_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (ok) frames_++;
+    return ok;
+}
+
+std::string TestVideo::StatsString() const {
+    std::string stats =
+        Sprintf("decoded %d frames in %d ms(%.2f ms/frame), %lld AVFrames allocated", frames_,
+                (int)(decode_secs_ * 1000), frames_ > 0 ? decode_secs_ * 1000 / frames_ : 0.,
+                (long long)frame_allocations());
+    if (skipped_ > 0) stats += Sprintf(", %d skipped", skipped_);
+    return stats;
+}
+
+bool TestVideo::Decode(FrameHandle* frame) {
+    frame->Reset();
+    while (state_ != kEnd) {
+        if (state_ == kReading) {
+            if (!pkt_pending_) {
+                const int rc = ReadPacket();
+                if (rc == AVERROR(EAGAIN)) {
+                    Backoff();
+                    continue;
+                }
+                ResetBackoff();
+                if (rc < 0) {
+                    if (rc < 0 && rc != AVERROR_EOF) {
+                        LOG(WARNING) << "av_read_frame failed: " << FfmpegErrStr(rc);
+                    }
+                    // Flush the decoder, which still holds the frames of the last packets.
+                    avcodec_send_packet(dec_ctx_, nullptr);
+                    flushed_ = true;
+                    state_ = kDecoding;
+                    continue;
+                }
+                if (options_.keyframes_only && (pkt_->flags & AV_PKT_FLAG_KEY) == 0) {
+                    skipped_++;
+                    continue;
+                }
+            }
+            const int rc = avcodec_send_packet(dec_ctx_, pkt_);
+            pkt_pending_ = rc == AVERROR(EAGAIN);
+            if (rc < 0 && !pkt_pending_) {
+                LOG(WARNING) << "avcodec_send_packet failed: " << FfmpegErrStr(rc);
+                continue;
+            }
+            state_ = kDecoding;
             continue;
         }
-        need_pkt_ = false;
+
+        // One packet may decode into several frames, and a flushed decoder gives out all the
+        // frames it held back, so receive until the decoder asks for input.
+        FrameHandle decoded = pool_.Get();
+        const int rc = avcodec_receive_frame(dec_ctx_, decoded.get());
+        if (rc == 0) {
+            // A segment does not end at the keyframe of the next one: with an open GOP, the
+            // pictures that lead that keyframe follow it in decode order but come before it, and
+            // the next segment drops them. Frames come out in presentation order, so the segment
+            // is complete at the first one at or after its end.
+            const int64_t pts = decoded->best_effort_timestamp;
+            if (end_pts_ != AV_NOPTS_VALUE && pts != AV_NOPTS_VALUE && pts >= end_pts_) {
+                state_ = kEnd;
+                continue;
+            }
+            if (!Sample(decoded.get())) {
+                skipped_++;
+                continue;
+            }
+            if (Convert(&decoded, frame)) return true;
+        } else if (rc == AVERROR(EAGAIN)) {
+            state_ = flushed_ ? kEnd : kReading;
+        } else if (rc == AVERROR_EOF) {
+            state_ = kEnd;
+        } else {
+            LOG(WARNING) << "avcodec_receive_frame failed: " << FfmpegErrStr(rc);
+            state_ = flushed_ ? kEnd : kReading;
+        }
     }
+    return false;
+}
 
-    // Decode.
-    AVFrame* decoded = av_frame_alloc();
-    int rc = avcodec_receive_frame(dec_ctx_, decoded);
+bool TestVideo::Seek(int64_t start_pts, int64_t end_pts) {
+    const int rc = av_seek_frame(fmt_ctx_, video_->index, start_pts, AVSEEK_FLAG_BACKWARD);
     if (rc < 0) {
-        if (rc == AVERROR_EOF) return nullptr;
-        if (rc != AVERROR(EAGAIN)) {
-            LOG(WARNING) << "avcodec_receive_frame failed: " << FfmpegErrStr(rc);
+        LOG(ERROR) << "av_seek_frame(" << start_pts << ") failed: " << FfmpegErrStr(rc);
+        return false;
+    }
+    avcodec_flush_buffers(dec_ctx_);
+    av_packet_unref(pkt_);
+    state_ = kReading;
+    pkt_pending_ = false;
+    flushed_ = false;
+    decoded_ = 0;
+    next_pts_ = AV_NOPTS_VALUE;
+    start_pts_ = start_pts;
+    end_pts_ = end_pts;
+    return true;
+}
+
+bool TestVideo::ScanKeyframes(std::vector<int64_t>* keyframe_pts, int* packets) {
+    keyframe_pts->clear();
+    // Of every packet, to count those from the first keyframe on once that is known.
+    std::vector<int64_t> packet_pts;
+    while (true) {
+        const int rc = ReadPacket();
+        if (rc == AVERROR(EAGAIN)) {
+            Backoff();
+            continue;
+        }
+        if (rc < 0) break;
+        ResetBackoff();
+        const int64_t pts = PacketPts();
+        if (packets != nullptr) packet_pts.push_back(pts);
+        if ((pkt_->flags & AV_PKT_FLAG_KEY) == 0) continue;
+        if (pts == AV_NOPTS_VALUE) {
+            LOG(ERROR) << "Keyframe without timestamp";
+            return false;
         }
-        av_frame_free(&decoded);
-        need_pkt_ = true;
-        return NextFrame();
+        keyframe_pts->push_back(pts);
     }
+    ResetBackoff();
+    std::sort(keyframe_pts->begin(), keyframe_pts->end());
+    if (keyframe_pts->empty()) {
+        LOG(ERROR) << "No keyframes found";
+        return false;
+    }
+    if (packets != nullptr) {
+        // Packets without a timestamp count, the decoder gives their frames one.
+        const int64_t first = keyframe_pts->front();
+        *packets = std::count_if(packet_pts.begin(), packet_pts.end(), [first](int64_t pts) {
+            return pts == AV_NOPTS_VALUE || pts >= first;
+        });
+    }
+    return Seek(keyframe_pts->front(), AV_NOPTS_VALUE);
+}
 
-    // Convert.
-    rc = av_buffersrc_add_frame_flags(
-        in_, decoded, AV_BUFFERSRC_FLAG_KEEP_REF | AV_BUFFERSRC_FLAG_PUSH);
-    av_frame_free(&decoded);
+int64_t TestVideo::PacketPts() const {
+    return pkt_->pts != AV_NOPTS_VALUE ? pkt_->pts : pkt_->dts;
+}
+
+bool TestVideo::Sample(const AVFrame* frame) {
+    const int64_t pts = frame->best_effort_timestamp;
+    if (pts != AV_NOPTS_VALUE) {
+        if (start_pts_ != AV_NOPTS_VALUE && pts < start_pts_) return false;
+    }
+    if (options_.every_nth > 1) return decoded_++ % options_.every_nth == 0;
+    if (sample_interval_ == 0 || pts == AV_NOPTS_VALUE) return true;
+    if (next_pts_ != AV_NOPTS_VALUE && pts < next_pts_) return false;
+    // Keep to the grid of due times, unless the video jumped ahead of it.
+    if (next_pts_ == AV_NOPTS_VALUE || pts - next_pts_ >= sample_interval_) {
+        next_pts_ = pts + sample_interval_;
+    } else {
+        next_pts_ += sample_interval_;
+    }
+    return true;
+}
+
+bool TestVideo::Convert(FrameHandle* decoded, FrameHandle* frame) {
+    if (graph_ == nullptr) {
+        (*decoded)->pts = (*decoded)->best_effort_timestamp;
+        *frame = std::move(*decoded);
+        return true;
+    }
+
+    // The buffer source takes over the reference of |decoded|.
+    int rc = av_buffersrc_add_frame_flags(in_, decoded->get(), AV_BUFFERSRC_FLAG_PUSH);
+    decoded->Reset();
     if (rc < 0) {
         LOG(ERROR) << "av_buffersrc_add_frame_flags failed: " << FfmpegErrStr(rc);
-        return NextFrame();
+        return false;
     }
-    AVFrame* frame = av_frame_alloc();
-    rc = av_buffersink_get_frame_flags(out_, frame, AV_BUFFERSINK_FLAG_NO_REQUEST);
+    *frame = pool_.Get();
+    rc = av_buffersink_get_frame_flags(out_, frame->get(), AV_BUFFERSINK_FLAG_NO_REQUEST);
     if (rc < 0) {
         LOG(ERROR) << "av_buffersink_get_frame_flags failed: " << FfmpegErrStr(rc);
-        av_frame_free(&frame);
-        return NextFrame();
+        frame->Reset();
+        return false;
     }
-    frame->pts = frame->best_effort_timestamp;
-    return frame;
+    (*frame)->pts = (*frame)->best_effort_timestamp;
+    return true;
 }
 
-bool TestVideo::ReadPacket() {
-    av_packet_unref(pkt_);
-    const int rc = av_read_frame(fmt_ctx_, pkt_);
-    if (rc == AVERROR(EAGAIN)) {
-        av_usleep(100);
-    } else if (rc < 0) {
-        // EOF
-        return false;
-    } else if ((pkt_->flags & AV_PKT_FLAG_CORRUPT) != 0) {
-        LOG(WARNING) << "Read corrupted packet.";
-    } else if (pkt_->stream_index == video_->index) {
-        return true;
+int TestVideo::ReadPacket() {
+    while (true) {
+        av_packet_unref(pkt_);
+        const int rc = av_read_frame(fmt_ctx_, pkt_);
+        if (rc < 0) return rc;
+        if ((pkt_->flags & AV_PKT_FLAG_CORRUPT) != 0) {
+            LOG(WARNING) << "Read corrupted packet.";
+        } else if (pkt_->stream_index == video_->index) {
+            return 0;
+        }
     }
-    return ReadPacket();
+}
+
+void TestVideo::Backoff() {
+    // libavformat has no way to wait for input to become readable, so poll. Starting short
+    // keeps the latency low when data is about to arrive, the cap bounds the wasted wake-ups.
+    const int kMinBackoffUs = 100;
+    const int kMaxBackoffUs = 10000;
+    backoff_us_ = backoff_us_ == 0 ? kMinBackoffUs : std::min(2 * backoff_us_, kMaxBackoffUs);
+    av_usleep(backoff_us_);
 }
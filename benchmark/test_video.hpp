@@ -1,17 +1,89 @@
 #ifndef TEST_VIDEO_HPP_
 #define TEST_VIDEO_HPP_
 
+#include <string>
+#include <vector>
+
+#include "frame_pool.hpp"
 #include "utils.hpp"
 
+// How TestVideo decodes. The defaults do all the work on the thread that calls NextFrame.
+struct DecodeOptions {
+    // Decoder threads, 0 for one per core.
+    int threads = 1;
+    // "frame" decodes consecutive frames in parallel, which scales best but delays every frame by
+    // one frame per extra thread. "slice" splits each frame and adds no delay, but only helps
+    // streams encoded with several slices. "auto" lets the decoder pick.
+    std::string thread_type = "auto";
+    // Threads of the filter graph that scales and converts frames, 0 for one per core.
+    int filter_threads = 1;
+
+    // Sampling, for jobs that only need a few frames per second. Frames that are not sampled are
+    // dropped as early as possible: before decoding where that is safe, otherwise right after it,
+    // before any conversion.
+    //
+    // Only decode keyframes. Other packets are dropped before they reach the decoder.
+    bool keyframes_only = false;
+    // Return every Nth decoded frame.
+    int every_nth = 1;
+    // If > 0, return about this many frames per second of video time. When that is well below the
+    // frame rate of the video, the decoder also skips frames no other frame refers to.
+    double target_fps = 0;
+};
+
+// A part of a video, from a keyframe up to but not including |end_pts|, in the time base of the
+// video. An |end_pts| of AV_NOPTS_VALUE means up to the end.
+struct VideoSegment {
+    int64_t start_pts;
+    int64_t end_pts;
+};
+
+// Cuts a video with the given keyframe timestamps into at most |count| segments of about equal
+// duration, each starting at a keyframe. Returns one open ended segment if there are no keyframes
+// to cut at.
+std::vector<VideoSegment> SplitAtKeyframes(const std::vector<int64_t>& keyframe_pts, int count);
+
 class TestVideo {
   public:
-    TestVideo(enum AVPixelFormat pix_fmt, uint32_t width, uint32_t height);
+    TestVideo(enum AVPixelFormat pix_fmt, uint32_t width, uint32_t height,
+              const DecodeOptions& options = DecodeOptions());
     ~TestVideo();
 
     bool Init(const std::string& file, const char* format, bool keep_ar);
 
-    // Caller takes ownership of the returned frame and must call av_frame_free on it.
-    AVFrame* NextFrame();
+    // Decodes the next frame into |frame|, which goes back to this video's frame pool when the
+    // handle is reset or destroyed. Returns false at the end of the video, once the decoder has
+    // given out the frames it held back. On a live source that has no data yet, waits with a
+    // growing back-off, capped at a few milliseconds.
+    // When the decoder already outputs |pix_fmt| at the requested size, the frame is the
+    // decoder's own, with its linesize padding and color range, and no filter graph is used.
+    // A yuvj420p source counts as yuv420p here.
+    bool NextFrame(FrameHandle* frame);
+
+    // Continues decoding at the first frame at or after |start_pts|, in time_base() units, and
+    // ends the video before the first frame at or after |end_pts| unless that is AV_NOPTS_VALUE.
+    // Frames between the keyframe before |start_pts| and |start_pts| are decoded but not
+    // returned, and decoding goes on past the keyframe at |end_pts| until the frames that come
+    // before it, e.g. the leading pictures of an open GOP, are out. So segments that start and
+    // end at the same keyframes add up to the whole video.
+    bool Seek(int64_t start_pts, int64_t end_pts);
+
+    // Reads through the whole video without decoding it and returns the timestamps of its
+    // keyframes, in time_base() units. Call right after Init; the video is rewound afterwards.
+    // If |packets| is not null, it is set to the number of video packets from the first keyframe
+    // on in presentation order: the frames a decode from there returns, for codecs that put one
+    // frame into each packet.
+    bool ScanKeyframes(std::vector<int64_t>* keyframe_pts, int* packets = nullptr);
+
+    // Number of AVFrames allocated so far. Only grows while more frames are held at once than
+    // before, so in steady state it stays flat.
+    int64_t frame_allocations() const { return pool_.allocations(); }
+
+    int frames() const { return frames_; }
+    // Time spent in NextFrame: reading, decoding and converting.
+    double decode_secs() const { return decode_secs_; }
+    // Decode time per frame and frame allocations, for the benchmark output.
+    std::string StatsString() const;
 
     uint32_t width() const { return width_; }
     uint32_t height() const { return height_; }
@@ -19,15 +91,57 @@ class TestVideo {
     AVRational time_base() const { return video_->time_base; }
 
   private:
-    bool ReadPacket();
+    enum State {
+        // Needs the next packet, or to resend |pkt_| if the decoder was full.
+        kReading,
+        // The decoder may have frames, receive them until it asks for input.
+        kDecoding,
+        // The decoder has been flushed and has no more frames.
+        kEnd,
+    };
+
+    bool Decode(FrameHandle* frame);
+    // Reads the next video packet into |pkt_|. Returns 0, AVERROR(EAGAIN) if a live source has
+    // no data yet, or another error at the end of the input.
+    int ReadPacket();
+    // Sleeps before polling a live source again. Each call waits twice as long as the last one,
+    // up to a cap, until ResetBackoff.
+    void Backoff();
+    void ResetBackoff() { backoff_us_ = 0; }
+    // Timestamp of |pkt_|, AV_NOPTS_VALUE if unknown.
+    int64_t PacketPts() const;
+    // Returns whether the decoded |frame| is sampled.
+    bool Sample(const AVFrame* frame);
+    // Converts |decoded| into |frame|. Returns false if the frame was dropped.
+    bool Convert(FrameHandle* decoded, FrameHandle* frame);
 
+    // Frames handed out by NextFrame must be returned before the video is destroyed.
+    FramePool pool_;
     const enum AVPixelFormat pix_fmt_;
+    const DecodeOptions options_;
     uint32_t width_, height_;
     AVFormatContext* fmt_ctx_ = nullptr;
     AVStream* video_ = nullptr;
     AVCodecContext* dec_ctx_ = nullptr;
     AVPacket* pkt_ = nullptr;
-    bool need_pkt_ = true;
+    State state_ = kReading;
+    // |pkt_| was refused by a full decoder and has to be sent again.
+    bool pkt_pending_ = false;
+    // The end of the input has been reached and the decoder flushed.
+    bool flushed_ = false;
+    int backoff_us_ = 0;
+    // Sampling state: frames decoded so far, the time base units between two frames at
+    // |target_fps| and the timestamp the next frame is due at.
+    int64_t decoded_ = 0;
+    int64_t sample_interval_ = 0;
+    int64_t next_pts_ = AV_NOPTS_VALUE;
+    // Range set by Seek.
+    int64_t start_pts_ = AV_NOPTS_VALUE;
+    int64_t end_pts_ = AV_NOPTS_VALUE;
+    int frames_ = 0;
+    // Frames and packets dropped by sampling before or after decoding.
+    int skipped_ = 0;
+    double decode_secs_ = 0;
     AVFilterGraph* graph_ = nullptr;
     AVFilterContext* in_ = nullptr;
     AVFilterContext* out_ = nullptr;
@@ -0,0 +1,85 @@
+#ifndef TFLITE_CPU_HPP_
+#define TFLITE_CPU_HPP_
+
+#include <string>
+
+#include <glog/logging.h>
+#include <tensorflow/lite/interpreter.h>
+#ifdef TFLITE_XNNPACK
+#include <tensorflow/lite/delegates/xnnpack/xnnpack_delegate.h>
+#endif
+
+// How a TFLite interpreter runs on the CPU, shared by classify_lite and obj_detect_lite.
+//
+// The builtin kernels are the ones libtensorflow-lite was built with: ruy for the GEMMs if it was
+// built with TFLITE_WITH_RUY=true, gemmlowp and Eigen otherwise. XNNPACK is a delegate, so it can
+// be picked per interpreter, but only if the benchmarks are built with TFLITE_XNNPACK=1.
+struct TfliteCpuOptions {
+    enum Delegate {
+        kNone,
+        kXnnpack,
+    };
+
+    Delegate delegate = kNone;
+    // Threads of the builtin kernels, and of the delegate.
+    int threads = 1;
+};
+
+inline const char* TfliteDelegateName(TfliteCpuOptions::Delegate delegate) {
+    switch (delegate) {
+        case TfliteCpuOptions::kNone:
+            return "none";
+        case TfliteCpuOptions::kXnnpack:
+            return "xnnpack";
+    }
+    return nullptr;
+}
+
+inline bool ParseTfliteDelegate(const std::string& name, TfliteCpuOptions::Delegate* delegate) {
+    if (name == "none") {
+        *delegate = TfliteCpuOptions::kNone;
+    } else if (name == "xnnpack") {
+        *delegate = TfliteCpuOptions::kXnnpack;
+    } else {
+        LOG(ERROR) << "Unknown TFLite delegate '" << name << "', expected none or xnnpack";
+        return false;
+    }
+    return true;
+}
+
+// Whether |delegate| has been built in.
+inline bool HasTfliteDelegate(TfliteCpuOptions::Delegate delegate) {
+#ifdef TFLITE_XNNPACK
+    const bool has_xnnpack = true;
+#else
+    const bool has_xnnpack = false;
+#endif
+    return delegate != TfliteCpuOptions::kXnnpack || has_xnnpack;
+}
+
+// Sets the threads of |interpreter| and hands it the delegate of |options|. Call it once the
+// input has its final shape and the tensors are allocated. The interpreter owns the delegate.
+inline bool ApplyTfliteCpuOptions(const TfliteCpuOptions& options,
+                                  tflite::Interpreter* interpreter) {
+    interpreter->SetNumThreads(options.threads);
+    if (options.delegate == TfliteCpuOptions::kNone) return true;
+    if (!HasTfliteDelegate(options.delegate)) {
+        LOG(ERROR) << "Built without " << TfliteDelegateName(options.delegate)
+                   << ", rebuild with TFLITE_XNNPACK=1";
+        return false;
+    }
+#ifdef TFLITE_XNNPACK
+    TfLiteXNNPackDelegateOptions xnnpack_options = TfLiteXNNPackDelegateOptionsDefault();
+    xnnpack_options.num_threads = options.threads;
+    tflite::Interpreter::TfLiteDelegatePtr delegate(TfLiteXNNPackDelegateCreate(&xnnpack_options),
+                                                    TfLiteXNNPackDelegateDelete);
+    if (interpreter->ModifyGraphWithDelegate(std::move(delegate)) != kTfLiteOk) {
+        LOG(ERROR) << "Failed to apply the " << TfliteDelegateName(options.delegate)
+                   << " delegate!";
+        return false;
+    }
+#endif
+    return true;
+}
+
+#endif  // TFLITE_CPU_HPP_
@@ -1,6 +1,8 @@
 #ifndef UTILS_HPP_
 #define UTILS_HPP_
 
+#include <time.h>
+
 #include <string>
 
 extern "C" {
@@ -13,6 +15,7 @@ extern "C" {
 #include <libavutil/opt.h>
 #include <libavutil/pixdesc.h>
 #include <libavutil/time.h>
+#include <libswscale/swscale.h>
 }  // extern "C"
 
 #ifndef ARRAYSIZE
@@ -28,6 +31,13 @@ inline std::string Sprintf(const char* format, ...) {
     return buf;
 }
 
+// CPU time of all threads of the process, e.g. of a thread pool that the timed code runs on.
+inline double ProcessCpuSecs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 inline std::string FfmpegErrStr(int rc) {
     char err_buf[200];
     if (av_strerror(rc, err_buf, ARRAYSIZE(err_buf)) == 0) {
@@ -1,8 +1,13 @@
 #include "video_encoder.hpp"
 
+#include <algorithm>
+#include <chrono>
+
 #include <glog/logging.h>
 
-VideoEncoder::VideoEncoder() {
+VideoEncoder::VideoEncoder(const EncoderOptions& options)
+    : options_(options), free_frames_(std::max(1, options.queue_depth)),
+      queued_frames_(std::max(1, options.queue_depth) + 1) {
 }
 
 VideoEncoder::~VideoEncoder() {
@@ -22,9 +27,15 @@ AVRational get_supported_framerate(const AVCodec* codec, const AVRational hint)
 bool VideoEncoder::Init(enum AVPixelFormat pix_fmt, int width, int height, AVRational time_base,
                         const std::string& output_file) {
     // Create AVFormatContext.
-    int rc = avformat_alloc_output_context2(&fmt_ctx_, nullptr, "matroska", nullptr);
+    if (options_.bitrate <= 0 && options_.crf < 0 && options_.qp < 0) {
+        LOG(ERROR) << "No rate control given: need a bitrate, crf or qp";
+        return false;
+    }
+    const char* container = options_.container.empty() ? nullptr : options_.container.c_str();
+    int rc = avformat_alloc_output_context2(&fmt_ctx_, nullptr, container, output_file.c_str());
     if (rc < 0) {
-        LOG(ERROR) << "avformat_alloc_output_context2 failed: " << FfmpegErrStr(rc);
+        LOG(ERROR) << "avformat_alloc_output_context2(" << options_.container << ") failed: "
+            << FfmpegErrStr(rc);
         return false;
     }
     // 0.5s.
@@ -62,18 +73,25 @@ bool VideoEncoder::Init(enum AVPixelFormat pix_fmt, int width, int height, AVRat
     enc_ctx_->slices = 1;
     enc_ctx_->has_b_frames = 0;
     enc_ctx_->max_b_frames = 0;
-    enc_ctx_->qmin = 0;
-    enc_ctx_->qmax = 20;
-    enc_ctx_->thread_count = 1;
+    enc_ctx_->thread_count = options_.threads;
     enc_ctx_->refs = 1;
-    enc_ctx_->gop_size = 100;
+    enc_ctx_->gop_size = options_.gop_size;
 
-    enc_ctx_->time_base = video_->time_base = time_base;
+    enc_ctx_->time_base = video_->time_base = time_base_ = time_base;
 
     AVDictionary* opts = nullptr;
-    av_dict_set(&opts, "preset", "fast", 0);
-    av_dict_set(&opts, "profile", "baseline", 0);
-    av_dict_set(&opts, "qp", "20", 0);
+    av_dict_set(&opts, "preset", options_.preset.c_str(), 0);
+    if (!options_.tune.empty()) av_dict_set(&opts, "tune", options_.tune.c_str(), 0);
+    if (!options_.profile.empty()) av_dict_set(&opts, "profile", options_.profile.c_str(), 0);
+    if (options_.bitrate > 0) {
+        enc_ctx_->bit_rate = options_.bitrate;
+    } else if (options_.crf >= 0) {
+        av_dict_set(&opts, "crf", Sprintf("%g", options_.crf).c_str(), 0);
+    } else {
+        enc_ctx_->qmin = 0;
+        enc_ctx_->qmax = options_.qp;
+        av_dict_set_int(&opts, "qp", options_.qp, 0);
+    }
     rc = avcodec_open2(enc_ctx_, video_codec, &opts);
     av_dict_free(&opts);
     if (rc < 0) {
@@ -87,74 +105,15 @@ bool VideoEncoder::Init(enum AVPixelFormat pix_fmt, int width, int height, AVRat
     }
 
     if (pix_fmt != AV_PIX_FMT_YUV420P) {
-        // Create filter graph.
-        graph_ = avfilter_graph_alloc();
-        if (graph_ == nullptr) {
-            LOG(ERROR) << "avfilter_graph_alloc failed!";
-            return false;
-        }
-        av_opt_set_int(graph_, "threads", 1, 0);
-        // Create "buffer" filter.
-        const AVFilter* buffersrc  = avfilter_get_by_name("buffer");
-        const std::string buffersrc_args = Sprintf(
-            "video_size=%dx%d:pix_fmt=%s:time_base=1/90000", width, height,
-            av_get_pix_fmt_name(pix_fmt));
-        rc = avfilter_graph_create_filter(&in_, buffersrc, "in", buffersrc_args.c_str(), nullptr,
-                                          graph_);
-        if (rc < 0) {
-            LOG(ERROR) << "avfilter_graph_create_filter(buffer=" << buffersrc_args
-                << ") failed: " << FfmpegErrStr(rc);
-            return false;
-        }
-        // Create "buffersink" filter.
-        const AVFilter* buffersink = avfilter_get_by_name("buffersink");
-        rc = avfilter_graph_create_filter(&out_, buffersink, "out", nullptr, nullptr, graph_);
-        if (rc < 0) {
-            LOG(ERROR) << "avfilter_graph_create_filter(buffersink) failed: " << FfmpegErrStr(rc);
-            return false;
-        }
-        enum AVPixelFormat pix_fmts[] = { AV_PIX_FMT_YUV420P, AV_PIX_FMT_NONE };
-        rc = av_opt_set_int_list(out_, "pix_fmts", pix_fmts, AV_PIX_FMT_NONE,
-                                 AV_OPT_SEARCH_CHILDREN);
-        if (rc < 0) {
-            LOG(ERROR) << "av_opt_set_int_list pix_fmts failed: " << FfmpegErrStr(rc);
-            return false;
-        }
-        // Generate filter string.
-        std::string filter_str;
-#define ADD_FILTER(name, format, args...) \
-        do { \
-            if (!filter_str.empty()) filter_str += ','; \
-            filter_str += Sprintf("%s=" format, name, args); \
-        } while (false)
-        ADD_FILTER("format", "%s", av_get_pix_fmt_name(AV_PIX_FMT_YUV420P));
-#undef ADD_FILTER
-        VLOG(1) << "Using filter '" << filter_str << "'...";
-        // Create filter chain.
-        AVFilterInOut* outputs = avfilter_inout_alloc();
-        outputs->name = av_strdup("in");
-        outputs->filter_ctx = in_;
-        outputs->pad_idx = 0;
-        outputs->next = nullptr;
-        AVFilterInOut* inputs  = avfilter_inout_alloc();
-        inputs->name = av_strdup("out");
-        inputs->filter_ctx = out_;
-        inputs->pad_idx = 0;
-        inputs->next = nullptr;
-        rc = avfilter_graph_parse_ptr(graph_, filter_str.c_str(), &inputs, &outputs, nullptr);
-        avfilter_inout_free(&inputs);
-        avfilter_inout_free(&outputs);
-        if (rc < 0) {
-            LOG(ERROR) << "avfilter_graph_parse_ptr(" << filter_str << ") failed: "
-                << FfmpegErrStr(rc);
-            return false;
-        }
-        rc = avfilter_graph_config(graph_, nullptr);
-        if (rc < 0) {
-            LOG(ERROR) << "avfilter_graph_config failed: " << FfmpegErrStr(rc);
+        // The input is only converted, never scaled, so the fastest filter does.
+        sws_ = sws_getContext(width, height, pix_fmt, width, height, AV_PIX_FMT_YUV420P,
+                              SWS_FAST_BILINEAR, nullptr, nullptr, nullptr);
+        if (sws_ == nullptr) {
+            LOG(ERROR) << "sws_getContext failed for " << av_get_pix_fmt_name(pix_fmt);
             return false;
         }
     }
+    pix_fmt_ = pix_fmt;
 
     // Create IO.
     rc = avio_open(&fmt_ctx_->pb, output_file.c_str(), AVIO_FLAG_WRITE);
@@ -171,35 +130,91 @@ bool VideoEncoder::Init(enum AVPixelFormat pix_fmt, int width, int height, AVRat
         LOG(ERROR) << "avformat_write_header failed: " << FfmpegErrStr(rc);
         return false;
     }
-    return true;
-}
 
-bool VideoEncoder::EncodeAVFrame(AVFrame* frame) {
-    bool success = true;
-    // Flush encoder buffer.
-    if (frame == nullptr) {
-        if ((enc_ctx_->codec->capabilities | AV_CODEC_CAP_DELAY) != 0) success = DoEncode(nullptr);
-    } else if (graph_ != nullptr) {
-        // Convert.
-        int rc = av_buffersrc_add_frame_flags(
-            in_, frame, AV_BUFFERSRC_FLAG_KEEP_REF | AV_BUFFERSRC_FLAG_PUSH);
+    // Allocate the frames to fill and what the encoder thread reuses for every frame.
+    for (int i = 0; i < std::max(1, options_.queue_depth); i++) {
+        AVFrame* frame = av_frame_alloc();
+        frame->format = AV_PIX_FMT_YUV420P;
+        frame->width = width;
+        frame->height = height;
+        rc = av_frame_get_buffer(frame, 0);
+        all_frames_.push_back(frame);
         if (rc < 0) {
-            LOG(ERROR) << "av_buffersrc_add_frame_flags failed: " << FfmpegErrStr(rc);
+            LOG(ERROR) << "av_frame_get_buffer failed: " << FfmpegErrStr(rc);
             return false;
         }
-        AVFrame* converted = av_frame_alloc();
-        rc = av_buffersink_get_frame_flags(out_, converted, AV_BUFFERSINK_FLAG_NO_REQUEST);
-        if (rc < 0) {
-            LOG(ERROR) << "av_buffersink_get_frame_flags failed: " << FfmpegErrStr(rc);
-            return false;
+        free_frames_.Push(frame);
+    }
+    pkt_ = av_packet_alloc();
+    thread_ = std::thread(&VideoEncoder::EncodeLoop, this);
+    return true;
+}
+
+AVFrame* VideoEncoder::GetFrame() {
+    AVFrame* frame = nullptr;
+    if (!free_frames_.Pop(&frame)) return nullptr;
+    // The encoder may still hold a reference to the buffers of the frame. Only then they are
+    // copied.
+    av_frame_make_writable(frame);
+    return frame;
+}
+
+bool VideoEncoder::EncodeImage(const uint8_t* data, int stride, int64_t pts) {
+    if (sws_ == nullptr) {
+        LOG(ERROR) << "EncodeImage needs a packed input format, got "
+            << av_get_pix_fmt_name(pix_fmt_);
+        return false;
+    }
+    AVFrame* frame = GetFrame();
+    if (frame == nullptr) return false;
+    const auto start = std::chrono::high_resolution_clock::now();
+    const uint8_t* const src[4] = {data, nullptr, nullptr, nullptr};
+    const int src_stride[4] = {stride, 0, 0, 0};
+    sws_scale(sws_, src, src_stride, 0, frame->height, frame->data, frame->linesize);
+    const std::chrono::duration<double> duration =
+        std::chrono::high_resolution_clock::now() - start;
+    convert_secs_ += duration.count();
+    frame->pts = pts;
+    return Submit(frame);
+}
+
+bool VideoEncoder::Submit(AVFrame* frame) {
+    if (!queued_frames_.Push(frame)) {
+        LOG(ERROR) << "Frame submitted after Flush";
+        free_frames_.Push(frame);
+        return false;
+    }
+    return ok_;
+}
+
+bool VideoEncoder::Flush() {
+    if (thread_.joinable()) {
+        queued_frames_.Push(nullptr);
+        queued_frames_.Close();
+        thread_.join();
+    }
+    return ok_;
+}
+
+void VideoEncoder::EncodeLoop() {
+    AVFrame* frame = nullptr;
+    while (queued_frames_.Pop(&frame)) {
+        // After a failure frames are only recycled, so that callers do not block forever.
+        if (ok_) {
+            const auto start = std::chrono::high_resolution_clock::now();
+            if (!DoEncode(frame)) ok_ = false;
+            const std::chrono::duration<double> duration =
+                std::chrono::high_resolution_clock::now() - start;
+            encode_secs_ += duration.count();
         }
-        converted->pts = frame->pts;
-        success = DoEncode(converted);
-        av_frame_free(&converted);
-    } else {
-        success = DoEncode(frame);
+        if (frame == nullptr) break;
+        frames_++;
+        if (frame->pts != AV_NOPTS_VALUE) {
+            min_pts_ = min_pts_ == AV_NOPTS_VALUE ? frame->pts : std::min(min_pts_, frame->pts);
+            max_pts_ = max_pts_ == AV_NOPTS_VALUE ? frame->pts : std::max(max_pts_, frame->pts);
+        }
+        free_frames_.Push(frame);
     }
-    return success;
 }
 
 bool VideoEncoder::DoEncode(AVFrame* frame) {
@@ -210,20 +225,17 @@ bool VideoEncoder::DoEncode(AVFrame* frame) {
     }
 
     while (true) {
-        AVPacket* pkt = av_packet_alloc();
-        int rc = avcodec_receive_packet(enc_ctx_, pkt);
-        if (rc == AVERROR(EAGAIN) || rc == AVERROR_EOF) {
-            av_packet_free(&pkt);
-            break;
-        }
+        int rc = avcodec_receive_packet(enc_ctx_, pkt_);
+        if (rc == AVERROR(EAGAIN) || rc == AVERROR_EOF) break;
         if (rc < 0) {
             LOG(ERROR) << "avcodec_receive_packet failed: " << FfmpegErrStr(rc);
             break;
         }
         // ffmpeg might change the pts randomly when it's huge. No idea why though.
-        if (frame != nullptr) pkt->dts = pkt->pts = frame->pts;
-        rc = av_write_frame(fmt_ctx_, pkt);
-        av_packet_free(&pkt);
+        if (frame != nullptr) pkt_->dts = pkt_->pts = frame->pts;
+        bytes_ += pkt_->size;
+        rc = av_write_frame(fmt_ctx_, pkt_);
+        av_packet_unref(pkt_);
         if (rc < 0) {
             LOG(ERROR) << "av_write_frame failed: " << FfmpegErrStr(rc);
             return false;
@@ -232,8 +244,28 @@ bool VideoEncoder::DoEncode(AVFrame* frame) {
     return true;
 }
 
+double VideoEncoder::bitrate() const {
+    if (frames_ < 2 || max_pts_ <= min_pts_) return 0;
+    // The last frame lasts about as long as the average one.
+    const double secs = (max_pts_ - min_pts_) * av_q2d(time_base_) * frames_ / (frames_ - 1);
+    return bytes_ * 8 / secs;
+}
+
+std::string VideoEncoder::StatsString() const {
+    return Sprintf("encoded %d frames in %d ms(%.2f ms/frame, %.2f ms/frame converting), "
+                   "%.1f KiB, %.0f kbit/s", frames_, (int)(encode_secs_ * 1000),
+                   frames_ > 0 ? encode_secs_ * 1000 / frames_ : 0.,
+                   frames_ > 0 ? convert_secs_ * 1000 / frames_ : 0., bytes_ / 1024.,
+                   bitrate() / 1000);
+}
+
 void VideoEncoder::Close() {
-    avfilter_graph_free(&graph_);
+    Flush();
+    for (AVFrame* frame : all_frames_) av_frame_free(&frame);
+    all_frames_.clear();
+    av_packet_free(&pkt_);
+    sws_freeContext(sws_);
+    sws_ = nullptr;
     avcodec_free_context(&enc_ctx_);
     if (fmt_ctx_ != nullptr) {
         if (fmt_ctx_->pb != NULL) {
@@ -246,3 +278,111 @@ void VideoEncoder::Close() {
         avformat_close_input(&fmt_ctx_);
     }
 }
+
+namespace {
+
+// Copies the packets of the video stream of |input| to |out_ctx|. The output stream is created
+// from the first input and the header written before its first packet.
+bool AppendVideo(const std::string& input, AVFormatContext* out_ctx, int64_t* last_dts) {
+    AVFormatContext* in_ctx = nullptr;
+    int rc = avformat_open_input(&in_ctx, input.c_str(), nullptr, nullptr);
+    if (rc < 0) {
+        LOG(ERROR) << "avformat_open_input(" << input << ") failed: " << FfmpegErrStr(rc);
+        return false;
+    }
+    bool success = false;
+    AVPacket* pkt = av_packet_alloc();
+    do {
+        rc = avformat_find_stream_info(in_ctx, nullptr);
+        if (rc < 0) {
+            LOG(ERROR) << "avformat_find_stream_info(" << input << ") failed: "
+                << FfmpegErrStr(rc);
+            break;
+        }
+        const int index = av_find_best_stream(in_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+        if (index < 0) {
+            LOG(ERROR) << "No video stream in " << input;
+            break;
+        }
+        const AVStream* in_stream = in_ctx->streams[index];
+        if (out_ctx->nb_streams == 0) {
+            AVStream* out_stream = avformat_new_stream(out_ctx, nullptr);
+            if (out_stream == nullptr) {
+                LOG(ERROR) << "Failed to allocate stream!";
+                break;
+            }
+            rc = avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar);
+            if (rc < 0) {
+                LOG(ERROR) << "avcodec_parameters_copy failed: " << FfmpegErrStr(rc);
+                break;
+            }
+            out_stream->codecpar->codec_tag = 0;
+            out_stream->time_base = in_stream->time_base;
+            rc = avformat_write_header(out_ctx, nullptr);
+            if (rc < 0) {
+                LOG(ERROR) << "avformat_write_header failed: " << FfmpegErrStr(rc);
+                break;
+            }
+        }
+        // The muxer may have picked its own time base when writing the header.
+        const AVRational out_time_base = out_ctx->streams[0]->time_base;
+        success = true;
+        while (success && av_read_frame(in_ctx, pkt) >= 0) {
+            if (pkt->stream_index == index) {
+                av_packet_rescale_ts(pkt, in_stream->time_base, out_time_base);
+                if (*last_dts != AV_NOPTS_VALUE && pkt->dts != AV_NOPTS_VALUE &&
+                    pkt->dts <= *last_dts) {
+                    pkt->dts = *last_dts + 1;
+                    if (pkt->pts != AV_NOPTS_VALUE && pkt->pts < pkt->dts) pkt->pts = pkt->dts;
+                }
+                if (pkt->dts != AV_NOPTS_VALUE) *last_dts = pkt->dts;
+                pkt->stream_index = 0;
+                pkt->pos = -1;
+                rc = av_write_frame(out_ctx, pkt);
+                if (rc < 0) {
+                    LOG(ERROR) << "av_write_frame failed: " << FfmpegErrStr(rc);
+                    success = false;
+                }
+            }
+            av_packet_unref(pkt);
+        }
+    } while (false);
+    av_packet_free(&pkt);
+    avformat_close_input(&in_ctx);
+    return success;
+}
+
+}  // namespace
+
+bool ConcatVideos(const std::vector<std::string>& inputs, const std::string& container,
+                  const std::string& output_file) {
+    AVFormatContext* out_ctx = nullptr;
+    int rc = avformat_alloc_output_context2(
+        &out_ctx, nullptr, container.empty() ? nullptr : container.c_str(), output_file.c_str());
+    if (rc < 0) {
+        LOG(ERROR) << "avformat_alloc_output_context2 failed: " << FfmpegErrStr(rc);
+        return false;
+    }
+    rc = avio_open(&out_ctx->pb, output_file.c_str(), AVIO_FLAG_WRITE);
+    if (rc < 0) {
+        LOG(ERROR) << "avio_open(" << output_file << ") failed: " << FfmpegErrStr(rc);
+        avformat_free_context(out_ctx);
+        return false;
+    }
+    bool success = true;
+    int64_t last_dts = AV_NOPTS_VALUE;
+    for (const std::string& input : inputs) {
+        success = AppendVideo(input, out_ctx, &last_dts);
+        if (!success) break;
+    }
+    if (success && out_ctx->nb_streams > 0) {
+        rc = av_write_trailer(out_ctx);
+        if (rc < 0) {
+            LOG(ERROR) << "av_write_trailer failed: " << FfmpegErrStr(rc);
+            success = false;
+        }
+    }
+    avio_closep(&out_ctx->pb);
+    avformat_free_context(out_ctx);
+    return success;
+}
@@ -1,29 +1,112 @@
 #ifndef VIDEO_ENCODER_HPP_
 #define VIDEO_ENCODER_HPP_
 
+#include <atomic>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include "bounded_queue.hpp"
 #include "utils.hpp"
 
+// How VideoEncoder encodes with x264. The defaults favour quality; annotated output rarely needs
+// it, and "ultrafast" with "zerolatency" costs a fraction of the CPU.
+struct EncoderOptions {
+    // x264 preset, from "ultrafast" to "veryslow".
+    std::string preset = "fast";
+    // x264 tune, e.g. "zerolatency", which also drops the lookahead. Empty for none.
+    std::string tune;
+    // H.264 profile, empty to let x264 pick.
+    std::string profile = "baseline";
+    // Rate control: an average bitrate in bits per second if |bitrate| > 0, otherwise constant
+    // quality at |crf| if that is >= 0, otherwise a constant quantizer |qp|.
+    int64_t bitrate = 0;
+    double crf = -1;
+    int qp = 20;
+    int gop_size = 100;
+    // Encoder threads, 0 for one per core.
+    int threads = 1;
+    // Output format name, e.g. "matroska" or "mp4". Empty to guess it from the file name.
+    std::string container = "matroska";
+    // Frames being filled or waiting for the encoder thread.
+    int queue_depth = 2;
+};
+
+// Encodes frames to H.264 on a thread of its own. The caller converts an image into a recycled
+// YUV420P frame with EncodeImage, or fills one from GetFrame and hands it back with Submit.
+// Both return right away; encoding and muxing happen on the encoder thread. Up to queue_depth
+// frames are being filled or waiting for the encoder at a time, so with the default of 2 the
+// caller fills one frame while the encoder works on the other.
 class VideoEncoder {
   public:
-    VideoEncoder();
+    explicit VideoEncoder(const EncoderOptions& options = EncoderOptions());
     ~VideoEncoder();
 
+    // |pix_fmt| is the format of the images given to EncodeImage.
     bool Init(enum AVPixelFormat pix_fmt, int width, int height, AVRational time_base,
               const std::string& output_file);
-    bool EncodeAVFrame(AVFrame* frame);
+    // Converts a packed image, e.g. BGR24 or GRAY8, of the format and size given to Init and
+    // with rows |stride| bytes apart, into a frame from GetFrame and submits it. Not thread-safe.
+    bool EncodeImage(const uint8_t* data, int stride, int64_t pts);
+    // Returns a YUV420P frame of the size given to Init. Blocks while all frames are queued.
+    AVFrame* GetFrame();
+    // Queues |frame|, from GetFrame and with its pts set, for encoding. Returns false if
+    // encoding an earlier frame failed.
+    bool Submit(AVFrame* frame);
+    // Waits until all submitted frames are encoded and drains the encoder. No frames can be
+    // submitted afterwards. Returns false if encoding any frame failed.
+    bool Flush();
     void Close();
 
+    // Stats, complete once Flush has returned.
+    int frames() const { return frames_; }
+    // Time spent converting images in EncodeImage, on the caller's thread.
+    double convert_secs() const { return convert_secs_; }
+    // Time spent encoding and writing frames, on the encoder thread.
+    double encode_secs() const { return encode_secs_; }
+    int64_t bytes() const { return bytes_; }
+    // Average output bitrate over the video time the frames cover, in bits per second.
+    double bitrate() const;
+    std::string StatsString() const;
+
   private:
+    // Encoder thread.
+    void EncodeLoop();
     bool DoEncode(AVFrame* frame);
 
+    const EncoderOptions options_;
+    // Frames ready for GetFrame, and frames submitted for encoding. A null frame in
+    // |queued_frames_| asks the encoder thread to drain the encoder and exit.
+    BoundedQueue<AVFrame*> free_frames_;
+    BoundedQueue<AVFrame*> queued_frames_;
+    std::vector<AVFrame*> all_frames_;
+    std::thread thread_;
+    std::atomic<bool> ok_{true};
+    // Only used on the encoder thread, the stats only read after Flush.
+    AVPacket* pkt_ = nullptr;
+    int frames_ = 0;
+    double encode_secs_ = 0;
+    int64_t bytes_ = 0;
+    int64_t min_pts_ = AV_NOPTS_VALUE;
+    int64_t max_pts_ = AV_NOPTS_VALUE;
+    // Only used on the caller's thread.
+    double convert_secs_ = 0;
+    AVRational time_base_ = {0, 1};
+    // Input format of EncodeImage and its conversion to YUV420P, null if there is nothing to
+    // convert.
+    enum AVPixelFormat pix_fmt_ = AV_PIX_FMT_NONE;
+    SwsContext* sws_ = nullptr;
+
     AVFormatContext* fmt_ctx_ = nullptr;
     AVStream* video_ = nullptr;
     AVCodecContext* enc_ctx_ = nullptr;
-    AVFilterGraph* graph_ = nullptr;
-    AVFilterContext* in_ = nullptr;
-    AVFilterContext* out_ = nullptr;
 };
 
+// Joins |inputs|, videos with the same single video stream such as the separately encoded
+// segments of one video, into |output_file| in order without re-encoding. Timestamps are kept,
+// except that decode timestamps are nudged to keep increasing across the joins.
+// |container| is as in EncoderOptions.
+bool ConcatVideos(const std::vector<std::string>& inputs, const std::string& container,
+                  const std::string& output_file);
+
 #endif  // VIDEO_ENCODER_HPP_
@@ -0,0 +1,30 @@
+#include "video_stream.hpp"
+
+#include <stdio.h>
+
+#include <glog/logging.h>
+
+bool VideoStream::Open(const std::string& video_file, enum AVPixelFormat decode_pix_fmt,
+                       int width, int height, const DecodeOptions& decode_options,
+                       const std::string& output_name, OutputType output_type,
+                       enum AVPixelFormat encode_pix_fmt,
+                       const EncoderOptions& encoder_options) {
+    this->video_file = video_file;
+    this->output_name = output_name;
+    // Open input video.
+    test_video.reset(new TestVideo(decode_pix_fmt, width, height, decode_options));
+    if (!test_video->Init(video_file, nullptr, true)) {
+        return false;
+    }
+    // Open output.
+    return OpenOutputSink(output_type, output_name, encode_pix_fmt, test_video->width(),
+                          test_video->height(), test_video->time_base(), encoder_options, &sink);
+}
+
+void VideoStream::PrintStats() {
+    printf("%s: %s.\n", output_name.c_str(), test_video->StatsString().c_str());
+    if (sink != nullptr) {
+        sink->Close();
+        printf("%s: %s.\n", output_name.c_str(), sink->StatsString().c_str());
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef VIDEO_STREAM_HPP_
+#define VIDEO_STREAM_HPP_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "output_sink.hpp"
+#include "test_video.hpp"
+#include "utils.hpp"
+#include "video_encoder.hpp"
+
+// An input video together with the sink its results go to.
+struct VideoStream {
+    // Opens |video_file| for decoding into |decode_pix_fmt| frames of width x height (0 to keep
+    // the source size), and the sink of |output_type| at |output_name|. A video sink takes
+    // |encode_pix_fmt| images of the decoded size.
+    bool Open(const std::string& video_file, enum AVPixelFormat decode_pix_fmt, int width,
+              int height, const DecodeOptions& decode_options, const std::string& output_name,
+              OutputType output_type, enum AVPixelFormat encode_pix_fmt,
+              const EncoderOptions& encoder_options);
+
+    // Whether Write needs the annotated frame.
+    bool wants_image() const { return sink != nullptr && sink->wants_image(); }
+    // Hands the results of the next frame to the sink, if any.
+    bool Write(int64_t pts, const std::vector<Detection>& detections, const cv::Mat& image) {
+        detection_count += detections.size();
+        return sink == nullptr || sink->Write(pts, detections, image);
+    }
+    // Finishes the output.
+    bool Close() { return sink == nullptr || sink->Close(); }
+
+    // Prints the decoder stats and, once the sink is closed, the sink stats.
+    void PrintStats();
+
+    std::string video_file;
+    std::string output_name;
+    std::unique_ptr<TestVideo> test_video;
+    // Null if nothing is written.
+    std::unique_ptr<OutputSink> sink;
+    int frames = 0;
+    // Detections of all frames written, whether or not there is a sink.
+    int64_t detection_count = 0;
+};
+
+#endif  // VIDEO_STREAM_HPP_